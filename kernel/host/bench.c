@@ -0,0 +1,297 @@
+// Throughput, latency percentiles and fragmentation for the heap and physical
+// allocator. The workloads share one heap and run in order, so results depend
+// on what ran before them just like in the kernel.
+
+#include "harness.h"
+#include "memory/heap.h"
+#include "memory/physical.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#define BENCH_OPERATIONS (200000)
+#define BENCH_LIVE_MAX (4096)
+
+struct BENCH_SAMPLES {
+	uint64_t *cycles;
+	uint64_t count;
+};
+
+struct BENCH_LIVE {
+	void *address;
+	size_t size;
+};
+
+static struct BENCH_SAMPLES _alloc_samples = {0};
+static struct BENCH_SAMPLES _free_samples = {0};
+static struct BENCH_LIVE _live[BENCH_LIVE_MAX] = {0};
+static uint64_t _rng = 1;
+
+static uint64_t random_between(uint64_t low, uint64_t high)
+{
+	return low + host_rng_next(&_rng) % (high - low + 1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec time = {0};
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+static void record(struct BENCH_SAMPLES *samples, uint64_t cycles)
+{
+	if (samples->count < BENCH_OPERATIONS * 2) {
+		samples->cycles[samples->count++] = cycles;
+	}
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *)a;
+	uint64_t right = *(const uint64_t *)b;
+	return (left > right) - (left < right);
+}
+
+static void print_percentiles(const char *label, struct BENCH_SAMPLES *samples)
+{
+	if (samples->count == 0) {
+		return;
+	}
+
+	qsort(samples->cycles, samples->count, sizeof(uint64_t), compare_u64);
+
+	uint64_t *cycles = samples->cycles;
+	uint64_t count = samples->count;
+
+	host_printf("    %-6s cycles p50 %6lu  p90 %6lu  p99 %7lu  p99.9 %8lu  "
+				"max %9lu\n",
+				label, cycles[count * 50 / 100], cycles[count * 90 / 100],
+				cycles[count * 99 / 100], cycles[count * 999 / 1000],
+				cycles[count - 1]);
+}
+
+static void *timed_alloc(size_t size, size_t alignment)
+{
+	uint64_t start = __rdtsc();
+	void *address = kmalloc_aligned(size, alignment, KMALLOC_NOZERO);
+	record(&_alloc_samples, __rdtsc() - start);
+
+	if (address == NULL) {
+		fprintf(stderr, "Allocation of %zu bytes failed\n", size);
+		abort();
+	}
+
+	// Touch the memory like a real user would.
+	memset(address, 0xa5, size < 64 ? size : 64);
+
+	return address;
+}
+
+static void timed_free(void *address)
+{
+	uint64_t start = __rdtsc();
+	kfree(address);
+	record(&_free_samples, __rdtsc() - start);
+}
+
+static void free_live(void)
+{
+	for (uint64_t i = 0; i < BENCH_LIVE_MAX; i++) {
+		if (_live[i].address != NULL) {
+			kfree(_live[i].address);
+			_live[i].address = NULL;
+			_live[i].size = 0;
+		}
+	}
+}
+
+static void print_fragmentation(void)
+{
+	struct HEAP_STATS heap = {0};
+	struct PHYSICAL_STATS physical = {0};
+	heap_stats(&heap);
+	physical_stats(&physical);
+
+	size_t live_bytes = 0;
+	for (uint64_t i = 0; i < BENCH_LIVE_MAX; i++) {
+		live_bytes += _live[i].size;
+	}
+
+	// External fragmentation is the share of free heap memory which can not be
+	// handed out as one block.
+	double external = heap.free_bytes
+						  ? 100.0 * (1.0 - (double)heap.largest_free_block /
+											   (double)heap.free_bytes)
+						  : 0.0;
+
+	host_printf("    heap %lu bytes, live %lu bytes, free blocks %lu, "
+				"largest free %lu bytes, external fragmentation %.1f%%\n",
+				heap.heap_size, live_bytes, heap.free_blocks,
+				heap.largest_free_block, external);
+	host_printf("    physical used %lu of %lu pages, largest free run %lu "
+				"pages\n",
+				physical.used_pages, physical.total_pages,
+				physical.largest_free_run);
+}
+
+// Runs a workload which keeps up to `live_count` allocations alive and
+// replaces a random one each step.
+static void run_heap_workload(const char *name, uint64_t live_count,
+							  size_t min_size, size_t max_size,
+							  size_t alignment, uint64_t operations)
+{
+	_alloc_samples.count = 0;
+	_free_samples.count = 0;
+
+	uint64_t start = now_ns();
+
+	for (uint64_t i = 0; i < operations; i++) {
+		struct BENCH_LIVE *live = &_live[random_between(0, live_count - 1)];
+
+		if (live->address != NULL) {
+			timed_free(live->address);
+		}
+
+		live->size = random_between(min_size, max_size);
+		live->address = timed_alloc(live->size, alignment);
+	}
+
+	uint64_t elapsed = now_ns() - start;
+
+	host_printf("%s: %lu alloc/free pairs in %.1f ms, %.2f M pairs/s\n", name,
+				operations, elapsed / 1e6, operations * 1e3 / elapsed);
+	print_percentiles("alloc", &_alloc_samples);
+	print_percentiles("free", &_free_samples);
+	print_fragmentation();
+
+	free_live();
+}
+
+// Grows buffers by half their size at a time like a dynamic array would.
+static void run_realloc_workload(uint64_t operations)
+{
+	_alloc_samples.count = 0;
+
+	uint64_t start = now_ns();
+	uint64_t done = 0;
+
+	while (done < operations) {
+		size_t size = 16;
+		void *address = kmalloc(size);
+
+		while (size < 256 * 1024 && done < operations) {
+			size += size / 2;
+
+			uint64_t cycles = __rdtsc();
+			address = krealloc(address, size);
+			record(&_alloc_samples, __rdtsc() - cycles);
+
+			done++;
+		}
+
+		kfree(address);
+	}
+
+	uint64_t elapsed = now_ns() - start;
+
+	host_printf("realloc-grow: %lu reallocations in %.1f ms, %.2f M/s\n",
+				operations, elapsed / 1e6, operations * 1e3 / elapsed);
+	print_percentiles("resize", &_alloc_samples);
+}
+
+// Churns the physical allocator directly with single pages or small runs.
+static void run_physical_workload(const char *name, uint64_t max_pages,
+								  uint64_t operations)
+{
+	static phys_addr_t addresses[BENCH_LIVE_MAX];
+	static size_t sizes[BENCH_LIVE_MAX];
+
+	_alloc_samples.count = 0;
+	_free_samples.count = 0;
+
+	uint64_t start = now_ns();
+
+	for (uint64_t i = 0; i < operations; i++) {
+		uint64_t slot = random_between(0, BENCH_LIVE_MAX - 1);
+
+		if (sizes[slot] != 0) {
+			uint64_t cycles = __rdtsc();
+			release_memory(addresses[slot], sizes[slot]);
+			record(&_free_samples, __rdtsc() - cycles);
+		}
+
+		sizes[slot] = random_between(1, max_pages) * PAGE_BYTE_SIZE;
+
+		uint64_t cycles = __rdtsc();
+		err_code err = sizes[slot] == PAGE_BYTE_SIZE
+						   ? allocate_page(&addresses[slot])
+						   : allocate_memory(sizes[slot], &addresses[slot]);
+		record(&_alloc_samples, __rdtsc() - cycles);
+
+		if (err) {
+			fprintf(stderr, "Physical allocation failed\n");
+			abort();
+		}
+	}
+
+	uint64_t elapsed = now_ns() - start;
+
+	host_printf("%s: %lu alloc/free pairs in %.1f ms, %.2f M pairs/s\n", name,
+				operations, elapsed / 1e6, operations * 1e3 / elapsed);
+	print_percentiles("alloc", &_alloc_samples);
+	print_percentiles("free", &_free_samples);
+	print_fragmentation();
+
+	for (uint64_t i = 0; i < BENCH_LIVE_MAX; i++) {
+		if (sizes[i] != 0) {
+			release_memory(addresses[i], sizes[i]);
+			sizes[i] = 0;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t operations = BENCH_OPERATIONS;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			operations = strtoull(argv[++i], NULL, 0);
+			if (operations > BENCH_OPERATIONS) {
+				operations = BENCH_OPERATIONS;
+			}
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			_rng = strtoull(argv[++i], NULL, 0);
+		} else {
+			fprintf(stderr, "usage: %s [-n operations] [-s seed]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (_rng == 0) {
+		_rng = 1;
+	}
+
+	_alloc_samples.cycles = calloc(BENCH_OPERATIONS * 2, sizeof(uint64_t));
+	_free_samples.cycles = calloc(BENCH_OPERATIONS * 2, sizeof(uint64_t));
+
+	host_init_memory();
+
+	run_heap_workload("small-fixed", 64, 64, 64, KMALLOC_ALIGN_MIN, operations);
+	run_heap_workload("small-mixed", 1024, 1, 1024, KMALLOC_ALIGN_MIN,
+					  operations);
+	run_heap_workload("medium-mixed", 1024, 1025, 32 * 1024, KMALLOC_ALIGN_MIN,
+					  operations);
+	run_heap_workload("aligned", 256, 64, 2048, KMALLOC_ALIGN_PAGE,
+					  operations / 4);
+	run_heap_workload("large", 32, 64 * 1024, 1024 * 1024, KMALLOC_ALIGN_MIN,
+					  operations / 20);
+	run_realloc_workload(operations);
+	run_physical_workload("physical-page", 1, operations);
+	run_physical_workload("physical-run", 16, operations / 4);
+
+	return 0;
+}
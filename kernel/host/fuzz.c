@@ -0,0 +1,324 @@
+// Randomized allocation traces against the heap and physical allocator. Every
+// step is followed by a heap walk and a check of the memory it touched. Run
+// with `-s <seed>` to replay a failing trace.
+
+#include "harness.h"
+#include "memory/heap.h"
+#include "memory/pages.h"
+#include "memory/physical.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_SLOTS (2048)
+#define FUZZ_FRAME_SLOTS (512)
+#define FUZZ_FULL_CHECK_INTERVAL (1000)
+
+struct FUZZ_ALLOCATION {
+	uint8_t *address;
+	size_t size;
+	uint8_t pattern;
+};
+
+struct FUZZ_FRAME {
+	phys_addr_t address;
+	size_t size;
+	uint8_t pattern;
+};
+
+static struct FUZZ_ALLOCATION _allocations[FUZZ_SLOTS] = {0};
+static struct FUZZ_FRAME _frames[FUZZ_FRAME_SLOTS] = {0};
+static uint8_t *_owned_frames = NULL;
+static uint64_t _rng = 1;
+static uint64_t _seed = 1;
+static uint64_t _step = 0;
+
+static uint64_t random_below(uint64_t limit)
+{
+	return host_rng_next(&_rng) % limit;
+}
+
+static void fail(const char *reason, const void *address)
+{
+	fprintf(stderr, "FAIL seed=%lu step=%lu: %s (%p)\n", _seed, _step, reason,
+			address);
+	abort();
+}
+
+// Most allocations are small, some straddle the size classes and a few take
+// the page path.
+static size_t random_size(void)
+{
+	uint64_t bucket = random_below(100);
+
+	if (bucket < 70) {
+		return random_below(256) + 1;
+	}
+
+	if (bucket < 90) {
+		return random_below(8192 - 256) + 257;
+	}
+
+	if (bucket < 98) {
+		return random_below(64 * 1024 - 8192) + 8193;
+	}
+
+	return random_below(1024 * 1024) + 64 * 1024;
+}
+
+static void check_contents(const uint8_t *address, size_t size, uint8_t pattern)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (address[i] != pattern) {
+			fail("allocation contents were overwritten", address + i);
+		}
+	}
+}
+
+static void check_all(void)
+{
+	for (uint64_t i = 0; i < FUZZ_SLOTS; i++) {
+		struct FUZZ_ALLOCATION *allocation = &_allocations[i];
+		if (allocation->address != NULL) {
+			check_contents(allocation->address, allocation->size,
+						   allocation->pattern);
+		}
+	}
+
+	for (uint64_t i = 0; i < FUZZ_FRAME_SLOTS; i++) {
+		struct FUZZ_FRAME *frame = &_frames[i];
+		if (frame->size != 0) {
+			check_contents(phys_to_virt(frame->address), frame->size,
+						   frame->pattern);
+		}
+	}
+}
+
+static void fuzz_alloc(struct FUZZ_ALLOCATION *allocation)
+{
+	size_t size = random_size();
+	size_t alignment = KMALLOC_ALIGN_MIN;
+	bool zeroed = false;
+	uint8_t *address = NULL;
+
+	switch (random_below(4)) {
+	case 0:
+		address = kmalloc(size);
+		break;
+	case 1:
+		address = kzalloc(size);
+		zeroed = true;
+		break;
+	case 2:
+		alignment = 1ULL << random_below(13);
+		zeroed = random_below(2);
+		address = kmalloc_aligned(size, alignment,
+								  zeroed ? 0 : KMALLOC_NOZERO);
+		break;
+	default:
+		address = kmalloc_flags(size, KMALLOC_NOZERO);
+		break;
+	}
+
+	if (address == NULL) {
+		fail("allocation failed", NULL);
+	}
+
+	if ((uintptr_t)address % KMALLOC_ALIGN_MIN ||
+		(uintptr_t)address % alignment) {
+		fail("allocation is misaligned", address);
+	}
+
+	if (zeroed) {
+		check_contents(address, size, 0);
+	}
+
+	allocation->address = address;
+	allocation->size = size;
+	allocation->pattern = (uint8_t)(random_below(255) + 1);
+	memset(address, allocation->pattern, size);
+}
+
+static void fuzz_realloc(struct FUZZ_ALLOCATION *allocation)
+{
+	size_t size = random_size();
+	uint8_t *address = krealloc(allocation->address, size);
+	if (address == NULL) {
+		fail("reallocation failed", allocation->address);
+	}
+
+	size_t kept = size < allocation->size ? size : allocation->size;
+	check_contents(address, kept, allocation->pattern);
+
+	allocation->address = address;
+	allocation->size = size;
+	memset(address, allocation->pattern, size);
+}
+
+static void fuzz_free(struct FUZZ_ALLOCATION *allocation)
+{
+	kfree(allocation->address);
+	allocation->address = NULL;
+	allocation->size = 0;
+}
+
+// Frames handed out must be usable, must not already be owned and must not
+// alias heap memory. Aliasing shows up as a pattern mismatch later.
+static void fuzz_frame_alloc(struct FUZZ_FRAME *frame)
+{
+	phys_addr_t address = 0;
+	size_t size = PAGE_BYTE_SIZE;
+
+	if (random_below(2)) {
+		if (allocate_page(&address)) {
+			fail("page allocation failed", NULL);
+		}
+	} else {
+		size = (random_below(16) + 1) * PAGE_BYTE_SIZE;
+		if (allocate_memory(size, &address)) {
+			fail("contiguous allocation failed", NULL);
+		}
+	}
+
+	for (phys_addr_t page = address; page < address + size;
+		 page += PAGE_BYTE_SIZE) {
+		if (!host_frame_usable(page)) {
+			fail("frame is not in a usable region", (void *)page);
+		}
+
+		if (_owned_frames[page / PAGE_BYTE_SIZE]) {
+			fail("frame was handed out twice", (void *)page);
+		}
+
+		_owned_frames[page / PAGE_BYTE_SIZE] = 1;
+	}
+
+	frame->address = address;
+	frame->size = size;
+	frame->pattern = (uint8_t)(random_below(255) + 1);
+	memset(phys_to_virt(address), frame->pattern, size);
+}
+
+static void fuzz_frame_free(struct FUZZ_FRAME *frame)
+{
+	check_contents(phys_to_virt(frame->address), frame->size, frame->pattern);
+
+	for (phys_addr_t page = frame->address;
+		 page < frame->address + frame->size; page += PAGE_BYTE_SIZE) {
+		_owned_frames[page / PAGE_BYTE_SIZE] = 0;
+	}
+
+	if (release_memory(frame->address, frame->size)) {
+		fail("frame release failed", (void *)frame->address);
+	}
+
+	frame->size = 0;
+}
+
+static void fuzz_step(void)
+{
+	uint64_t operation = random_below(100);
+
+	if (operation < 90) {
+		struct FUZZ_ALLOCATION *allocation =
+			&_allocations[random_below(FUZZ_SLOTS)];
+
+		if (allocation->address == NULL) {
+			fuzz_alloc(allocation);
+		} else {
+			check_contents(allocation->address, allocation->size,
+						   allocation->pattern);
+
+			if (operation < 20) {
+				fuzz_realloc(allocation);
+			} else {
+				fuzz_free(allocation);
+			}
+		}
+	} else {
+		struct FUZZ_FRAME *frame = &_frames[random_below(FUZZ_FRAME_SLOTS)];
+
+		if (frame->size == 0) {
+			fuzz_frame_alloc(frame);
+		} else {
+			fuzz_frame_free(frame);
+		}
+	}
+
+	if (!heap_validate()) {
+		fail("heap validation failed", NULL);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t steps = 200000;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			_seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			steps = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-v") == 0) {
+			host_verbose = true;
+		} else {
+			fprintf(stderr, "usage: %s [-s seed] [-n steps] [-v]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	_rng = _seed ? _seed : 1;
+
+	host_init_memory();
+
+	struct PHYSICAL_STATS physical_start = {0};
+	struct HEAP_STATS heap_start = {0};
+	physical_stats(&physical_start);
+	heap_stats(&heap_start);
+
+	_owned_frames = calloc(physical_start.total_pages, 1);
+
+	for (_step = 0; _step < steps; _step++) {
+		fuzz_step();
+
+		if (_step % FUZZ_FULL_CHECK_INTERVAL == 0) {
+			check_all();
+		}
+	}
+
+	check_all();
+
+	for (uint64_t i = 0; i < FUZZ_SLOTS; i++) {
+		if (_allocations[i].address != NULL) {
+			fuzz_free(&_allocations[i]);
+		}
+	}
+
+	for (uint64_t i = 0; i < FUZZ_FRAME_SLOTS; i++) {
+		if (_frames[i].size != 0) {
+			fuzz_frame_free(&_frames[i]);
+		}
+	}
+
+	if (!heap_validate()) {
+		fail("heap validation failed after freeing everything", NULL);
+	}
+
+	// Everything is free again so the only frames still in use are the ones
+	// the heap grew by.
+	struct PHYSICAL_STATS physical_end = {0};
+	struct HEAP_STATS heap_end = {0};
+	physical_stats(&physical_end);
+	heap_stats(&heap_end);
+
+	uint64_t heap_growth =
+		(heap_end.heap_size - heap_start.heap_size) / PAGE_BYTE_SIZE;
+	if (physical_end.used_pages != physical_start.used_pages + heap_growth) {
+		fail("physical pages leaked", NULL);
+	}
+
+	host_printf("OK seed=%lu steps=%lu heap=%lu bytes cached objects=%lu\n",
+				_seed, steps, heap_end.heap_size, heap_end.cached_objects);
+
+	return 0;
+}
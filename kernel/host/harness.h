@@ -0,0 +1,22 @@
+#ifndef __HOST_HARNESS_H
+#define __HOST_HARNESS_H 1
+
+#include "memory/memory.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// When false kernel `printf` output is discarded.
+extern bool host_verbose;
+
+// Sets up mocked physical memory, the physical allocator and the heap.
+void host_init_memory(void);
+
+// Returns true if the frame lies in a usable region of the mocked memory map.
+bool host_frame_usable(phys_addr_t physical_address);
+
+__attribute__((format(printf, 1, 2))) int
+host_printf(const char *restrict format, ...);
+
+uint64_t host_rng_next(uint64_t *state);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __CPU_H
+#define __CPU_H 1
+
+#include <stdint.h>
+
+// Host stand-in for the kernel's `cpu.h`. Each harness thread plays one CPU
+// and sets its index before touching the allocators.
+#define MAX_CPUS (32)
+
+extern __thread uint32_t host_cpu_index;
+
+static inline uint32_t cpu_index(void) { return host_cpu_index; }
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __INSTRUCTION_H
+#define __INSTRUCTION_H
+
+#include <stdint.h>
+
+// Host stand-in for the kernel's `instruction.h` with only what the allocators
+// use. There are no interrupts to disable in user space.
+
+static inline uint64_t read_tsc(void)
+{
+	uint32_t low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline uint64_t save_and_disable_interrupts(void) { return 0; }
+
+static inline void restore_interrupts(uint64_t flags) { (void)flags; }
+
+static inline void cpu_relax(void) { asm volatile("pause" ::: "memory"); }
+
+#endif
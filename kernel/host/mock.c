@@ -0,0 +1,354 @@
+// Host stand-ins for the pieces of the kernel the memory allocators depend on.
+//
+// Physical memory is a sparse memfd. The HHDM is one shared mapping of the
+// whole file, and `map_memory` maps single pages of the file into reserved
+// virtual ranges. Writes through a mapping are therefore visible through the
+// HHDM exactly like on real hardware, and unmapped pages fault. The page table
+// stand-in is guarded by a mutex since harness threads play separate CPUs.
+
+#define _GNU_SOURCE
+
+#include "cpu.h"
+#include "harness.h"
+#include "memory/heap.h"
+#include "memory/memory.h"
+#include "memory/physical.h"
+#include "memory/virtual.h"
+#include "panic.h"
+#include <limine.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HOST_RAM_SIZE (1ULL << 30)
+#define HOST_HEAP_RESERVE (4ULL << 30)
+#define HOST_HEAP_INITIAL_SIZE (0x1000 * 32)
+
+struct HOST_REGION {
+	uintptr_t base;
+	size_t size;
+	phys_addr_t *translations; /* Frame per page, 0 when unmapped */
+};
+
+static int _ram_fd = -1;
+static struct HOST_REGION _heap_region = {0};
+static struct HOST_REGION _page_region = {0};
+static pthread_mutex_t _mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool host_verbose = false;
+__thread uint32_t host_cpu_index = 0;
+
+//
+// Limine responses
+//
+
+static struct limine_memmap_entry _memmap_entries[] = {
+	{.base = 0x0, .length = 0x100000, .type = LIMINE_MEMMAP_RESERVED},
+	{.base = 0x100000, .length = 0x7f00000, .type = LIMINE_MEMMAP_USABLE},
+	{.base = 0x8000000,
+	 .length = 0x400000,
+	 .type = LIMINE_MEMMAP_KERNEL_AND_MODULES},
+	{.base = 0x8400000, .length = 0x7c00000, .type = LIMINE_MEMMAP_USABLE},
+	{.base = 0x10000000,
+	 .length = 0x100000,
+	 .type = LIMINE_MEMMAP_ACPI_RECLAIMABLE},
+	{.base = 0x10100000,
+	 .length = HOST_RAM_SIZE - 0x10100000,
+	 .type = LIMINE_MEMMAP_USABLE},
+};
+
+static struct limine_memmap_entry *_memmap_entry_pointers[] = {
+	&_memmap_entries[0], &_memmap_entries[1], &_memmap_entries[2],
+	&_memmap_entries[3], &_memmap_entries[4], &_memmap_entries[5],
+};
+
+static struct limine_memmap_response _memmap_response = {
+	.entry_count = sizeof(_memmap_entries) / sizeof(_memmap_entries[0]),
+	.entries = _memmap_entry_pointers,
+};
+
+static struct limine_hhdm_response _hhdm_response = {0};
+static struct limine_kernel_address_response _kernel_address_response = {0};
+
+volatile struct limine_memmap_request memmap_request = {
+	.id = LIMINE_MEMMAP_REQUEST, .response = &_memmap_response};
+volatile struct limine_hhdm_request hhdm_request = {
+	.id = LIMINE_HHDM_REQUEST, .response = &_hhdm_response};
+volatile struct limine_kernel_address_request kernel_address_request = {
+	.id = LIMINE_KERNEL_ADDRESS_REQUEST, .response = &_kernel_address_response};
+
+//
+// Kernel services
+//
+
+// Replaces the C library printf so kernel logging can be silenced. Harness
+// output goes through `host_printf`.
+int printf(const char *restrict format, ...)
+{
+	if (!host_verbose) {
+		return 0;
+	}
+
+	va_list args;
+	va_start(args, format);
+	int length = vfprintf(stdout, format, args);
+	va_end(args);
+
+	return length;
+}
+
+int host_printf(const char *restrict format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int length = vfprintf(stdout, format, args);
+	va_end(args);
+
+	return length;
+}
+
+NO_RETURN void halt()
+{
+	fflush(stdout);
+	abort();
+}
+
+NO_RETURN void panic()
+{
+	fprintf(stderr, "Kernel panic\n");
+	halt();
+}
+
+NO_RETURN void panicf(const char *restrict format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "Kernel panic: ");
+	vfprintf(stderr, format, args);
+	va_end(args);
+
+	halt();
+}
+
+//
+// Virtual memory
+//
+
+static void reserve_region(struct HOST_REGION *region, uintptr_t base,
+						   size_t size)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	if (base != 0) {
+		flags |= MAP_FIXED_NOREPLACE;
+	}
+
+	void *address = mmap((void *)base, size, PROT_NONE, flags, -1, 0);
+	if (address == MAP_FAILED || (base != 0 && (uintptr_t)address != base)) {
+		panicf("Failed to reserve %#lx bytes of address space\n", size);
+	}
+
+	region->base = (uintptr_t)address;
+	region->size = size;
+	region->translations = calloc(size / PAGE_BYTE_SIZE, sizeof(phys_addr_t));
+	if (region->translations == NULL) {
+		panicf("Failed to allocate a translation table\n");
+	}
+}
+
+static bool in_hhdm(uintptr_t address)
+{
+	return address >= _hhdm_response.offset &&
+		   address < _hhdm_response.offset + HOST_RAM_SIZE;
+}
+
+// Gets the translation slot for an address. Panics on addresses the kernel
+// would never map, since that is a bug in the allocator under test.
+static phys_addr_t *translation(uintptr_t address)
+{
+	struct HOST_REGION *regions[] = {&_heap_region, &_page_region};
+
+	for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+		struct HOST_REGION *region = regions[i];
+		if (address >= region->base && address < region->base + region->size) {
+			return &region->translations[(address - region->base) /
+										 PAGE_BYTE_SIZE];
+		}
+	}
+
+	panicf("Address %#lx is outside the reserved regions\n", address);
+}
+
+static bool map_page(phys_addr_t physical_address, uintptr_t virtual_address)
+{
+	if (physical_address % PAGE_BYTE_SIZE ||
+		virtual_address % PAGE_BYTE_SIZE) {
+		panicf("Unaligned mapping %#lx -> %#lx\n", virtual_address,
+			   physical_address);
+	}
+
+	if (physical_address >= HOST_RAM_SIZE) {
+		panicf("Mapping of non-existent frame %#lx\n", physical_address);
+	}
+
+	// The HHDM is always mapped on the host.
+	if (in_hhdm(virtual_address)) {
+		return true;
+	}
+
+	phys_addr_t *slot = translation(virtual_address);
+	if (*slot != 0) {
+		return false;
+	}
+
+	if (mmap((void *)virtual_address, PAGE_BYTE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_FIXED, _ram_fd,
+			 (off_t)physical_address) == MAP_FAILED) {
+		panicf("Failed to map %#lx -> %#lx\n", virtual_address,
+			   physical_address);
+	}
+
+	*slot = physical_address;
+	return true;
+}
+
+static bool unmap_page(uintptr_t virtual_address)
+{
+	if (in_hhdm(virtual_address)) {
+		return true;
+	}
+
+	phys_addr_t *slot = translation(virtual_address);
+	if (*slot == 0) {
+		return false;
+	}
+
+	if (mmap((void *)virtual_address, PAGE_BYTE_SIZE, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+			 0) == MAP_FAILED) {
+		panicf("Failed to unmap %#lx\n", virtual_address);
+	}
+
+	*slot = 0;
+	return true;
+}
+
+bool map_memory(phys_addr_t physical_address, virt_addr_t virtual_address,
+				size_t size_in_bytes, uint32_t flags)
+{
+	(void)flags;
+
+	bool mapped = true;
+
+	pthread_mutex_lock(&_mapping_lock);
+
+	for (uintptr_t offset = 0; offset < size_in_bytes;
+		 offset += PAGE_BYTE_SIZE) {
+		if (!map_page(physical_address + offset,
+					  (uintptr_t)virtual_address + offset)) {
+			mapped = false;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&_mapping_lock);
+
+	return mapped;
+}
+
+bool unmap_memory(virt_addr_t virtual_address, size_t size_in_bytes)
+{
+	bool all_mapped = true;
+
+	pthread_mutex_lock(&_mapping_lock);
+
+	for (uintptr_t offset = 0; offset < size_in_bytes;
+		 offset += PAGE_BYTE_SIZE) {
+		if (!unmap_page((uintptr_t)virtual_address + offset)) {
+			all_mapped = false;
+		}
+	}
+
+	pthread_mutex_unlock(&_mapping_lock);
+
+	return all_mapped;
+}
+
+bool translate_address(virt_addr_t virtual_address,
+					   phys_addr_t *output_physical_address)
+{
+	uintptr_t address = (uintptr_t)virtual_address;
+
+	if (in_hhdm(address)) {
+		*output_physical_address = address - _hhdm_response.offset;
+		return true;
+	}
+
+	pthread_mutex_lock(&_mapping_lock);
+	phys_addr_t physical_address =
+		*translation(address - address % PAGE_BYTE_SIZE);
+	pthread_mutex_unlock(&_mapping_lock);
+
+	if (physical_address == 0) {
+		return false;
+	}
+
+	*output_physical_address = physical_address + address % PAGE_BYTE_SIZE;
+	return true;
+}
+
+//
+// Harness setup
+//
+
+void host_init_memory(void)
+{
+	_ram_fd = memfd_create("physical-memory", 0);
+	if (_ram_fd < 0 || ftruncate(_ram_fd, HOST_RAM_SIZE) != 0) {
+		panicf("Failed to create the physical memory file\n");
+	}
+
+	void *hhdm = mmap(NULL, HOST_RAM_SIZE, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_NORESERVE, _ram_fd, 0);
+	if (hhdm == MAP_FAILED) {
+		panicf("Failed to map the HHDM\n");
+	}
+
+	_hhdm_response.offset = (uintptr_t)hhdm;
+
+	reserve_region(&_heap_region, 0, HOST_HEAP_RESERVE);
+	reserve_region(&_page_region, PAGE_ALLOCATION_BASE,
+				   PAGE_ALLOCATION_LIMIT - PAGE_ALLOCATION_BASE);
+
+	init_physical_memory();
+	init_heap((void *)_heap_region.base, HOST_HEAP_INITIAL_SIZE);
+}
+
+bool host_frame_usable(phys_addr_t physical_address)
+{
+	for (uint64_t i = 0; i < _memmap_response.entry_count; i++) {
+		struct limine_memmap_entry *entry = &_memmap_entries[i];
+
+		if (entry->type == LIMINE_MEMMAP_USABLE &&
+			physical_address >= entry->base &&
+			physical_address < entry->base + entry->length) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint64_t host_rng_next(uint64_t *state)
+{
+	// xorshift64*
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
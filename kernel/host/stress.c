@@ -0,0 +1,167 @@
+// Runs the kernel's allocator stress workload on several threads at once, each
+// playing a separate CPU, and reports how throughput scales with the thread
+// count. The workload panics on any corruption it sees.
+
+#include "cpu.h"
+#include "harness.h"
+#include "memory/heap.h"
+#include "memory/heap_stress.h"
+#include "memory/physical.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct STRESS_THREAD {
+	pthread_t thread;
+	uint32_t cpu;
+	uint64_t seed;
+	uint64_t operations;
+	struct HEAP_STRESS_RESULT result;
+};
+
+static pthread_barrier_t _start_barrier;
+
+static uint64_t now_ns(void)
+{
+	struct timespec time = {0};
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+static void *stress_thread(void *argument)
+{
+	struct STRESS_THREAD *thread = argument;
+
+	host_cpu_index = thread->cpu;
+
+	pthread_barrier_wait(&_start_barrier);
+	heap_stress_run(thread->seed, thread->operations, &thread->result);
+
+	return NULL;
+}
+
+// Runs one round on `thread_count` threads. Returns pairs per second.
+static double run_round(uint32_t thread_count, uint64_t seed,
+						uint64_t operations)
+{
+	struct STRESS_THREAD threads[MAX_CPUS] = {0};
+
+	pthread_barrier_init(&_start_barrier, NULL, thread_count + 1);
+
+	for (uint32_t i = 0; i < thread_count; i++) {
+		threads[i].cpu = i;
+		threads[i].seed = seed * MAX_CPUS + i + 1;
+		threads[i].operations = operations;
+
+		if (pthread_create(&threads[i].thread, NULL, stress_thread,
+						   &threads[i]) != 0) {
+			fprintf(stderr, "Failed to start thread %u\n", i);
+			abort();
+		}
+	}
+
+	pthread_barrier_wait(&_start_barrier);
+	uint64_t start = now_ns();
+
+	uint64_t remote_frees = 0;
+	for (uint32_t i = 0; i < thread_count; i++) {
+		pthread_join(threads[i].thread, NULL);
+		remote_frees += threads[i].result.remote_frees;
+	}
+
+	uint64_t elapsed = now_ns() - start;
+
+	pthread_barrier_destroy(&_start_barrier);
+
+	heap_stress_drain();
+
+	if (!heap_validate()) {
+		fprintf(stderr, "FAIL seed=%lu threads=%u: heap validation failed\n",
+				seed, thread_count);
+		abort();
+	}
+
+	double throughput = thread_count * operations * 1e3 / elapsed;
+
+	host_printf("%2u threads: %lu operations each in %.1f ms, %.2f M ops/s, "
+				"%lu remote frees\n",
+				thread_count, operations, elapsed / 1e6, throughput,
+				remote_frees);
+
+	return throughput;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t operations = 200000;
+	uint32_t max_threads = 4;
+	uint64_t seed = 1;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			operations = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			max_threads = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-v") == 0) {
+			host_verbose = true;
+		} else {
+			fprintf(stderr, "usage: %s [-n operations] [-t threads] [-s seed] "
+							"[-v]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+
+	if (max_threads == 0 || max_threads > MAX_CPUS) {
+		fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_CPUS);
+		return 2;
+	}
+
+	host_init_memory();
+
+	struct PHYSICAL_STATS physical_start = {0};
+	struct HEAP_STATS heap_start = {0};
+	physical_stats(&physical_start);
+	heap_stats(&heap_start);
+
+	double baseline = 0;
+	for (uint32_t threads = 1;; threads *= 2) {
+		if (threads > max_threads) {
+			threads = max_threads;
+		}
+
+		double throughput = run_round(threads, seed, operations);
+		if (baseline == 0) {
+			baseline = throughput;
+		}
+
+		host_printf("    scaling %.2fx\n", throughput / baseline);
+
+		if (threads == max_threads) {
+			break;
+		}
+	}
+
+	// Everything is free again so the only frames still in use are the ones
+	// the heap grew by.
+	struct PHYSICAL_STATS physical_end = {0};
+	struct HEAP_STATS heap_end = {0};
+	physical_stats(&physical_end);
+	heap_stats(&heap_end);
+
+	uint64_t heap_growth =
+		(heap_end.heap_size - heap_start.heap_size) / PAGE_BYTE_SIZE;
+	if (physical_end.used_pages != physical_start.used_pages + heap_growth) {
+		fprintf(stderr, "FAIL seed=%lu: physical pages leaked\n", seed);
+		abort();
+	}
+
+	host_printf("OK seed=%lu heap=%lu bytes cached objects=%lu\n", seed,
+				heap_end.heap_size, heap_end.cached_objects);
+
+	return 0;
+}
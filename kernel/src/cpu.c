@@ -0,0 +1,187 @@
+#include "cpu.h"
+#include "debug.h"
+#include "gdt.h"
+#include "instruction.h"
+#include "interrupts/idt.h"
+#include "macro.h"
+#include "memory/heap.h"
+#include "memory/heap_stress.h"
+#include "memory/memory.h"
+#include "memory/pages.h"
+#include "panic.h"
+#include "sched/scheduler.h"
+#include "string/utility.h"
+#include "type.h"
+#include <limine.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AP_STACK_PAGES (16)
+
+// Spin iterations to wait for an application processor before giving up.
+#define AP_ONLINE_TIMEOUT (1ULL << 30)
+
+ATTR_REQUEST volatile struct limine_smp_request smp_request = {
+	.id = LIMINE_SMP_REQUEST, .revision = 0, .flags = 0};
+
+// Area of the bootstrap processor, reserved by the linker script.
+extern char percpu_bsp[];
+
+// The control block goes into its own section so the linker script can place
+// it at the start of the template.
+__attribute__((used, section(".percpu.head"))) static struct CPU _cpu = {0};
+
+static struct CPU *_cpu_areas[MAX_CPUS] = {0};
+static uint32_t _cpu_count = 1;
+static uint64_t _kernel_cr3 = 0;
+
+static inline size_t percpu_size(void)
+{
+	return (size_t)(percpu_end - percpu_start);
+}
+
+// Copies the template and fills in the control block of the new area.
+static void setup_area(struct CPU *area, uint32_t index, uint32_t lapic_id)
+{
+	memcpy(area, percpu_start, percpu_size());
+
+	area->self = area;
+	area->index = index;
+	area->lapic_id = lapic_id;
+
+	_cpu_areas[index] = area;
+}
+
+struct CPU *cpu_area(uint32_t index)
+{
+	return index < MAX_CPUS ? _cpu_areas[index] : NULL;
+}
+
+uint32_t cpu_count(void) { return _cpu_count; }
+
+void init_cpu(void)
+{
+	struct CPU *area = (struct CPU *)percpu_bsp;
+
+	setup_area(area, 0, 0);
+	area->online = true;
+
+	write_msr(MSR_GS_BASE, (uintptr_t)area);
+}
+
+NO_RETURN static void ap_main(struct CPU *cpu)
+{
+	write_msr(MSR_GS_BASE, (uintptr_t)cpu);
+
+	enable_sse2();
+	init_ap_gdt();
+	load_idt();
+
+	__atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+
+	heap_stress(cpu_count());
+
+	scheduler_start_cpu();
+}
+
+// Entry point of the application processors. Limine starts them on its own
+// page tables and a small stack so both are replaced before anything else.
+NO_RETURN static void ap_entry(struct limine_smp_info *info)
+{
+	write_CR3(_kernel_cr3);
+
+	struct CPU *cpu = (struct CPU *)info->extra_argument;
+
+	asm volatile("movq %0, %%rsp\n\t"
+				 "xorq %%rbp, %%rbp\n\t"
+				 "call *%1" ::"r"(cpu->stack_top),
+				 "r"(ap_main), "D"(cpu)
+				 : "memory");
+
+	__builtin_unreachable();
+}
+
+// Prepares the area and stack of an application processor and starts it.
+// Returns once the processor is online.
+static err_code start_cpu(struct limine_smp_info *info, uint32_t index)
+{
+	struct CPU *area =
+		kmalloc_aligned(percpu_size(), CACHE_LINE_SIZE, KMALLOC_NOZERO);
+	if (area == NULL) {
+		return ERROR_INSUFFICIENT_SPACE;
+	}
+
+	void *stack = alloc_pages(AP_STACK_PAGES);
+	if (stack == NULL) {
+		kfree(area);
+		return ERROR_INSUFFICIENT_SPACE;
+	}
+
+	setup_area(area, index, info->lapic_id);
+	area->stack_top = (uintptr_t)stack + AP_STACK_PAGES * PAGE_BYTE_SIZE;
+
+	info->extra_argument = (uint64_t)area;
+	__atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+
+	for (uint64_t i = 0; !__atomic_load_n(&area->online, __ATOMIC_ACQUIRE);
+		 i++) {
+		if (i == AP_ONLINE_TIMEOUT) {
+			panicf("CPU %u (LAPIC %u) did not come online\n", index,
+				   info->lapic_id);
+		}
+
+		cpu_relax();
+	}
+
+	return 0;
+}
+
+void init_smp(void)
+{
+	err_code err = 0;
+	struct limine_smp_response *response = smp_request.response;
+
+	if (response == NULL) {
+		printf(KWARN "No SMP response, running on the bootstrap processor "
+					 "only\n");
+		return;
+	}
+
+	this_cpu()->lapic_id = response->bsp_lapic_id;
+	_kernel_cr3 = read_CR3();
+
+	uint32_t count = response->cpu_count;
+	if (count > MAX_CPUS) {
+		printf(KWARN "Only using %u of %u CPUs\n", MAX_CPUS, count);
+		count = MAX_CPUS;
+	}
+
+	printf(KINFO "Starting %u application processors...\n", count - 1);
+	printf("\tPer-CPU area: %'lu bytes\n", percpu_size());
+
+	// Set before any processor starts so they all agree on it.
+	_cpu_count = count;
+
+	uint32_t index = 1;
+	for (uint64_t i = 0; i < response->cpu_count && index < count; i++) {
+		struct limine_smp_info *info = response->cpus[i];
+
+		if (info->lapic_id == response->bsp_lapic_id) {
+			continue;
+		}
+
+		// They are started one at a time so their start up does not race.
+		if ((err = start_cpu(info, index))) {
+			debug_code(err);
+			panicf("Could not start CPU %u\n", index);
+		}
+
+		printf("\tCPU %u: LAPIC %u, stack top %#lx\n", index, info->lapic_id,
+			   cpu_area(index)->stack_top);
+
+		index++;
+	}
+
+	printf(KOK "%u CPUs online\n", count);
+}
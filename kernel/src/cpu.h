@@ -0,0 +1,75 @@
+#ifndef __CPU_H
+#define __CPU_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Upper bound on the number of processors the kernel will manage.
+#define MAX_CPUS (32)
+
+// Places a variable in the per-CPU template. Every processor works on its own
+// copy which is reached through `this_cpu_ptr` or `per_cpu_ptr`.
+#define ATTR_PER_CPU __attribute__((section(".percpu")))
+
+// Control block at the start of every per-CPU area. The GS base of each
+// processor points at its own block.
+struct CPU {
+	struct CPU *self; /* Lets `this_cpu` load the block with a single move */
+	uint32_t index;
+	uint32_t lapic_id;
+	uintptr_t stack_top;
+	bool online;
+};
+
+// Bounds of the per-CPU template, set by the linker script.
+extern char percpu_start[];
+extern char percpu_end[];
+
+// Gets the control block of the executing processor.
+static inline struct CPU *this_cpu(void)
+{
+	struct CPU *cpu;
+	asm volatile("movq %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+// Gets the index of the executing processor. The bootstrap processor is
+// always zero.
+static inline uint32_t cpu_index(void)
+{
+	uint32_t index;
+	asm volatile("movl %%gs:%c1, %0"
+				 : "=r"(index)
+				 : "i"(offsetof(struct CPU, index)));
+	return index;
+}
+
+// Gets the control block of the processor with the given index or NULL if it
+// was never started.
+struct CPU *cpu_area(uint32_t index);
+
+// Returns the number of processors the kernel runs on.
+uint32_t cpu_count(void);
+
+// Translates the address of a per-CPU variable into the given processor's
+// copy.
+#define per_cpu_ptr(variable, cpu)                                             \
+	((typeof(variable))((uintptr_t)(variable) - (uintptr_t)percpu_start +     \
+						(uintptr_t)cpu_area(cpu)))
+
+// Translates the address of a per-CPU variable into the executing processor's
+// copy. Interrupts should be off if the result is kept around since the
+// caller could otherwise end up on another processor.
+#define this_cpu_ptr(variable)                                                 \
+	((typeof(variable))((uintptr_t)(variable) - (uintptr_t)percpu_start +     \
+						(uintptr_t)this_cpu()))
+
+// Sets up the per-CPU area of the bootstrap processor. Has to run before
+// anything calls `cpu_index` or touches per-CPU variables.
+void init_cpu(void);
+
+// Starts the application processors and waits until they are all online.
+void init_smp(void);
+
+#endif
@@ -1,6 +1,7 @@
 #include "dwarf.h"
 #include "debug.h"
 #include "elf.h"
+#include "memory/arena.h"
 #include "memory/heap.h"
 #include "panic.h"
 #include "stdbool.h"
@@ -10,6 +11,10 @@
 #define DEBUG_STR(offset) ((char *)(_ctx.debug_str + offset))
 #define DEBUG_LINE_STR(offset) ((char *)(_ctx.debug_line_str + offset))
 
+// Queries keep their temporaries in a static scratch arena. They also run from
+// panics, possibly before the heap exists or while it is corrupt.
+#define DWARF_SCRATCH_SIZE (32 * 1024)
+
 struct DWARF_CONTEXT {
 	bool loaded;
 
@@ -46,6 +51,22 @@ struct DIE {
 
 struct DWARF_CONTEXT _ctx = {0};
 
+static uint8_t _scratch_buffer[DWARF_SCRATCH_SIZE] ATTR_CACHE_ALIGN;
+static struct ARENA _scratch = {0};
+
+static struct ARENA *_scratch_arena(void)
+{
+	if (_scratch.base == 0) {
+		arena_init(&_scratch, _scratch_buffer, DWARF_SCRATCH_SIZE);
+	}
+
+	return &_scratch;
+}
+
+// Allocates `count` elements of `type` from the scratch arena.
+#define SCRATCH_ARRAY(arena, type, count)                                      \
+	((type *)arena_alloc(arena, sizeof(type) * (count), _Alignof(type)))
+
 static inline struct DIE_ATTRIBUTE *_die_attribute(struct DIE *die,
 												   enum DW_AT attribute_code)
 {
@@ -563,8 +584,8 @@ static err_code _next_die(const DW_Chdr *cu, void **info_ptr,
 // an error code if an error or unsupported case is encountered. If no
 // function or function name is found then the `symbol_string` ouput remains
 // null.
-err_code dwarf_query_func(const uintptr_t instruction_address,
-						  char **symbol_string)
+static err_code _query_func(const uintptr_t instruction_address,
+							char **symbol_string, struct ARENA *scratch)
 {
 	err_code err = 0;
 
@@ -593,31 +614,37 @@ err_code dwarf_query_func(const uintptr_t instruction_address,
 		return ERROR_OUT_OF_BOUNDS;
 	}
 
+	struct DIE *die = SCRATCH_ARRAY(scratch, struct DIE, 1);
+	if (die == NULL) {
+		debug_code(ERROR_INSUFFICIENT_SPACE);
+		return ERROR_INSUFFICIENT_SPACE;
+	}
+
 	do {
-		struct DIE die = {0};
+		memset(die, 0, sizeof(struct DIE));
 
-		if ((err = _next_die(cu, &info_ptr, info_ptr_end, &die))) {
+		if ((err = _next_die(cu, &info_ptr, info_ptr_end, die))) {
 			debug_code(err);
 			return err;
 		}
 
-		if (die.abbreviation_code == 0 || die.tag_code != DW_TAG_subprogram) {
+		if (die->abbreviation_code == 0 || die->tag_code != DW_TAG_subprogram) {
 			continue;
 		}
 
-		struct DIE_ATTRIBUTE *low_pc = _die_attribute(&die, DW_AT_low_pc);
+		struct DIE_ATTRIBUTE *low_pc = _die_attribute(die, DW_AT_low_pc);
 		if (low_pc == NULL) {
 			continue;
 		}
 
-		struct DIE_ATTRIBUTE *high_pc = _die_attribute(&die, DW_AT_high_pc);
+		struct DIE_ATTRIBUTE *high_pc = _die_attribute(die, DW_AT_high_pc);
 		if (high_pc == NULL) {
 			continue;
 		}
 
 		if (instruction_address >= low_pc->value &&
 			instruction_address < low_pc->value + high_pc->value) {
-			struct DIE_ATTRIBUTE *name = _die_attribute(&die, DW_AT_name);
+			struct DIE_ATTRIBUTE *name = _die_attribute(die, DW_AT_name);
 			if (name == NULL) {
 				continue;
 			}
@@ -634,8 +661,22 @@ err_code dwarf_query_func(const uintptr_t instruction_address,
 	return 0;
 }
 
-err_code dwarf_query_line(const uintptr_t instruction_address,
-						  enum LINE_SELECT line_select, struct LINE_INFO *info)
+err_code dwarf_query_func(const uintptr_t instruction_address,
+						  char **symbol_string)
+{
+	struct ARENA *scratch = _scratch_arena();
+	arena_mark_t mark = arena_mark(scratch);
+
+	err_code err = _query_func(instruction_address, symbol_string, scratch);
+
+	arena_reset(scratch, mark);
+
+	return err;
+}
+
+static err_code _query_line(const uintptr_t instruction_address,
+							enum LINE_SELECT line_select,
+							struct LINE_INFO *info, struct ARENA *scratch)
 {
 	err_code err = 0;
 
@@ -671,19 +712,25 @@ err_code dwarf_query_line(const uintptr_t instruction_address,
 	// 1. Find .debug_line section offset
 	//
 
-	struct DIE die = {0};
-	if ((err = _next_die(cu_hdr, &info_ptr, info_ptr_end, &die))) {
+	struct DIE *die = SCRATCH_ARRAY(scratch, struct DIE, 1);
+	if (die == NULL) {
+		debug_code(ERROR_INSUFFICIENT_SPACE);
+		return ERROR_INSUFFICIENT_SPACE;
+	}
+
+	memset(die, 0, sizeof(struct DIE));
+	if ((err = _next_die(cu_hdr, &info_ptr, info_ptr_end, die))) {
 		debug_code(err);
 		return err;
 	}
 
-	if (die.tag_code != DW_TAG_compile_unit) {
+	if (die->tag_code != DW_TAG_compile_unit) {
 		// DW_TAG_compile_unit was not the first tag in the unit.
 		debug_code(DW_ERROR_INVALID_UNIT);
 		return DW_ERROR_INVALID_UNIT;
 	}
 
-	struct DIE_ATTRIBUTE *stmt_list = _die_attribute(&die, DW_AT_stmt_list);
+	struct DIE_ATTRIBUTE *stmt_list = _die_attribute(die, DW_AT_stmt_list);
 	if (stmt_list == NULL) {
 		// DW_TAG_compile_unit tag did not have a DW_AT_stmt_list attribute.
 		debug_code(DW_ERROR_INVALID_UNIT);
@@ -736,8 +783,15 @@ err_code dwarf_query_line(const uintptr_t instruction_address,
 		return ERROR_UNSUPPORTED;
 	}
 
-	uint16_t dir_entry_type[dir_entry_form_count];
-	uint16_t dir_entry_form[dir_entry_form_count];
+	uint16_t *dir_entry_type =
+		SCRATCH_ARRAY(scratch, uint16_t, dir_entry_form_count);
+	uint16_t *dir_entry_form =
+		SCRATCH_ARRAY(scratch, uint16_t, dir_entry_form_count);
+	if (dir_entry_type == NULL || dir_entry_form == NULL) {
+		debug_code(ERROR_INSUFFICIENT_SPACE);
+		return ERROR_INSUFFICIENT_SPACE;
+	}
+
 	for (int i = 0; i < dir_entry_form_count; i++) {
 		uint16_t type = 0;
 		if ((err =
@@ -764,7 +818,12 @@ err_code dwarf_query_line(const uintptr_t instruction_address,
 		return err;
 	}
 
-	char *dir_entry_str[directory_count];
+	char **dir_entry_str = SCRATCH_ARRAY(scratch, char *, directory_count);
+	if (dir_entry_str == NULL) {
+		debug_code(ERROR_INSUFFICIENT_SPACE);
+		return ERROR_INSUFFICIENT_SPACE;
+	}
+
 	for (int i = 0; i < directory_count; i++) {
 
 		if (dir_entry_type[0] == DW_LNCT_path &&
@@ -797,8 +856,15 @@ err_code dwarf_query_line(const uintptr_t instruction_address,
 		return ERROR_UNSUPPORTED;
 	}
 
-	uint16_t file_entry_type[file_entry_form_count];
-	uint16_t file_entry_form[file_entry_form_count];
+	uint16_t *file_entry_type =
+		SCRATCH_ARRAY(scratch, uint16_t, file_entry_form_count);
+	uint16_t *file_entry_form =
+		SCRATCH_ARRAY(scratch, uint16_t, file_entry_form_count);
+	if (file_entry_type == NULL || file_entry_form == NULL) {
+		debug_code(ERROR_INSUFFICIENT_SPACE);
+		return ERROR_INSUFFICIENT_SPACE;
+	}
+
 	for (int i = 0; i < file_entry_form_count; i++) {
 		uint16_t type = 0;
 		if ((err =
@@ -826,8 +892,14 @@ err_code dwarf_query_line(const uintptr_t instruction_address,
 		return err;
 	}
 
-	char *file_entry_str[file_names_count];
-	uint32_t file_entry_dir_index[file_names_count];
+	char **file_entry_str = SCRATCH_ARRAY(scratch, char *, file_names_count);
+	uint32_t *file_entry_dir_index =
+		SCRATCH_ARRAY(scratch, uint32_t, file_names_count);
+	if (file_entry_str == NULL || file_entry_dir_index == NULL) {
+		debug_code(ERROR_INSUFFICIENT_SPACE);
+		return ERROR_INSUFFICIENT_SPACE;
+	}
+
 	for (int i = 0; i < file_names_count; i++) {
 		if (file_entry_type[0] == DW_LNCT_path &&
 			file_entry_form[0] == DW_FORM_line_strp) {
@@ -1141,3 +1213,16 @@ err_code dwarf_query_line(const uintptr_t instruction_address,
 
 	return 0;
 }
+
+err_code dwarf_query_line(const uintptr_t instruction_address,
+						  enum LINE_SELECT line_select, struct LINE_INFO *info)
+{
+	struct ARENA *scratch = _scratch_arena();
+	arena_mark_t mark = arena_mark(scratch);
+
+	err_code err = _query_line(instruction_address, line_select, info, scratch);
+
+	arena_reset(scratch, mark);
+
+	return err;
+}
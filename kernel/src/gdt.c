@@ -2,6 +2,8 @@
 #include <stdbool.h>
 #include "gdt.h"
 #include "./string/utility.h"
+#include "cpu.h"
+#include "instruction.h"
 #include "macro.h"
 
 extern void load_gdt(uint16_t limit, uint64_t base);
@@ -64,43 +66,156 @@ union SEGMENT_DESCRIPTOR
 
 _Static_assert(sizeof(union SEGMENT_DESCRIPTOR) == sizeof(uint64_t));
 
-static union SEGMENT_DESCRIPTOR _gdt[8] = {0};
+// Long mode TSS descriptor. Takes up two GDT entries.
+// AMD64 Programmer’s Manual, Volume 2: PG 90
+struct TSS_DESCRIPTOR
+{
+	uint16_t limit_low;
+	uint16_t base_low;
+	uint8_t base_mid;
+	uint8_t
+		type : 4,
+		zero : 1,
+		privilege : 2,
+		present : 1;
+	uint8_t
+		limit_high : 4,
+		available_to_software : 1,
+		reserved_0 : 2,
+		granularity : 1;
+	uint8_t base_high;
+	uint32_t base_upper;
+	uint32_t reserved_1;
+} ATTR_PACK;
+
+_Static_assert(sizeof(struct TSS_DESCRIPTOR) == sizeof(uint64_t) * 2);
+
+// Long mode task state segment. Only the stack pointers are used.
+// AMD64 Programmer’s Manual, Volume 2: PG 378
+struct TSS
+{
+	uint32_t reserved_0;
+	uint64_t rsp[3];
+	uint64_t reserved_1;
+	uint64_t ist[7];
+	uint64_t reserved_2;
+	uint16_t reserved_3;
+	uint16_t io_map_base;
+} ATTR_PACK;
+
+_Static_assert(sizeof(struct TSS) == 104);
+
+#define TSS_TYPE_AVAILABLE (0x9)
+#define DOUBLE_FAULT_STACK_SIZE (4096)
+
+// Every processor has its own GDT since the TSS descriptor points at its own
+// TSS and gets marked busy once loaded.
+static union SEGMENT_DESCRIPTOR _gdt[GDT_ENTRY_COUNT] ATTR_PER_CPU = {0};
+static struct TSS _tss ATTR_PER_CPU = {0};
+static uint8_t _double_fault_stack[DOUBLE_FAULT_STACK_SIZE] ATTR_PER_CPU
+	__attribute__((aligned(16))) = {0};
 
 static inline uint16_t index_to_offset(uint16_t index)
 {
 	return index * sizeof(uint64_t);
 }
 
+static inline union SEGMENT_DESCRIPTOR *cpu_gdt(void)
+{
+	return this_cpu_ptr(&_gdt[0]);
+}
+
+static void write_tss_descriptor(uint16_t index, struct TSS *tss)
+{
+	struct TSS_DESCRIPTOR *descriptor =
+		(struct TSS_DESCRIPTOR *)&cpu_gdt()[index];
+	uintptr_t base = (uintptr_t)tss;
+	uint32_t limit = sizeof(struct TSS) - 1;
+
+	memset(descriptor, 0, sizeof(struct TSS_DESCRIPTOR));
+
+	descriptor->limit_low = limit & 0xffff;
+	descriptor->base_low = base & 0xffff;
+	descriptor->base_mid = (base >> 16) & 0xff;
+	descriptor->type = TSS_TYPE_AVAILABLE;
+	descriptor->privilege = PRIVILEGE_LVL_0;
+	descriptor->present = true;
+	descriptor->limit_high = (limit >> 16) & 0xf;
+	descriptor->base_high = (base >> 24) & 0xff;
+	descriptor->base_upper = base >> 32;
+}
+
+// Fills the executing processor's GDT and TSS.
+static void setup_gdt(void)
+{
+	union SEGMENT_DESCRIPTOR *gdt = cpu_gdt();
+	struct TSS *tss = this_cpu_ptr(&_tss);
+
+	gdt[0].raw = 0; // Null Descriptor
+
+	write_code_descriptor(GDT_KERNEL_CODE, PRIVILEGE_LVL_0, true);
+	write_data_descriptor(GDT_KERNEL_DATA, PRIVILEGE_LVL_0);
+	write_code_descriptor(GDT_USER_CODE, PRIVILEGE_LVL_3, true);
+	write_data_descriptor(GDT_USER_DATA, PRIVILEGE_LVL_3);
+
+	memset(tss, 0, sizeof(struct TSS));
+	tss->ist[IST_DOUBLE_FAULT - 1] =
+		(uintptr_t)this_cpu_ptr(&_double_fault_stack[0]) +
+		DOUBLE_FAULT_STACK_SIZE;
+	tss->io_map_base = sizeof(struct TSS); // No I/O permission bitmap
+
+	write_tss_descriptor(GDT_TSS, tss);
+}
+
+// Loads the executing processor's GDT and TSS.
+static void activate_gdt(void)
+{
+	// Reloading the segment registers clears the GS base, which holds the
+	// per-CPU pointer, so it is restored afterwards.
+	struct CPU *cpu = this_cpu();
+
+	load_gdt(sizeof(_gdt), (uintptr_t)cpu_gdt());
+	reload_segments(index_to_offset(GDT_KERNEL_CODE),
+					index_to_offset(GDT_KERNEL_DATA));
+	write_msr(MSR_GS_BASE, (uintptr_t)cpu);
+
+	uint16_t tss_selector = index_to_offset(GDT_TSS);
+	asm volatile("ltr %0" ::"r"(tss_selector));
+}
+
 void init_gdt(void)
 {
 	printf(KINFO "Setting up GDT entries...\n");
-	_gdt[0].raw = 0; // Null Descriptor
-
-	printf("\tNull Descriptor: %#018lx\n", _gdt[0].raw);
+	setup_gdt();
 
-	write_code_descriptor(1, PRIVILEGE_LVL_0, true); // Kernel code descriptor
-	write_data_descriptor(2, PRIVILEGE_LVL_0);		 // Kernel data descriptor
-	write_code_descriptor(3, PRIVILEGE_LVL_3, true); // Userspace code descriptor
-	write_data_descriptor(4, PRIVILEGE_LVL_3);		 // Userspace data descriptor
+	union SEGMENT_DESCRIPTOR *gdt = cpu_gdt();
 
-	printf("\tKernel code segment: %#018lx\n", _gdt[1].raw);
-	printf("\tKernel data segment: %#018lx\n", _gdt[2].raw);
-	printf("\tUser code segment: %#018lx\n", _gdt[3].raw);
-	printf("\tUser data segment: %#018lx\n", _gdt[4].raw);
+	printf("\tNull Descriptor: %#018lx\n", gdt[0].raw);
+	printf("\tKernel code segment: %#018lx\n", gdt[GDT_KERNEL_CODE].raw);
+	printf("\tKernel data segment: %#018lx\n", gdt[GDT_KERNEL_DATA].raw);
+	printf("\tUser code segment: %#018lx\n", gdt[GDT_USER_CODE].raw);
+	printf("\tUser data segment: %#018lx\n", gdt[GDT_USER_DATA].raw);
+	printf("\tTSS: %#018lx %#018lx\n", gdt[GDT_TSS + 1].raw,
+		   gdt[GDT_TSS].raw);
 
 	printf(KINFO "Loading GDT...\n");
 	printf("\tNew GDTR limit: %'lu bytes\n", sizeof(_gdt));
-	printf("\tNew GDTR base: %p\n", &_gdt);
+	printf("\tNew GDTR base: %p\n", gdt);
 
-	load_gdt(sizeof(_gdt), (uintptr_t)&_gdt);
-	reload_segments(index_to_offset(1), index_to_offset(2));
+	activate_gdt();
 
 	printf(KOK "GDT loaded\n");
 }
 
+void init_ap_gdt(void)
+{
+	setup_gdt();
+	activate_gdt();
+}
+
 void write_code_descriptor(uint16_t index, enum SEGMENT_PRIVILEGE privilege, bool conforming)
 {
-	struct CODE_SEGMENT_DESCRIPTOR *segment = &_gdt[index].code_descriptor;
+	struct CODE_SEGMENT_DESCRIPTOR *segment = &cpu_gdt()[index].code_descriptor;
 
 	segment->limit_low = 0xffff;
 	segment->base_low = 0;
@@ -127,7 +242,7 @@ void write_code_descriptor(uint16_t index, enum SEGMENT_PRIVILEGE privilege, boo
 
 void write_data_descriptor(uint16_t index, enum SEGMENT_PRIVILEGE privilege)
 {
-	struct DATA_SEGMENT_DESCRIPTOR *segment = &_gdt[index].data_descriptor;
+	struct DATA_SEGMENT_DESCRIPTOR *segment = &cpu_gdt()[index].data_descriptor;
 
 	segment->limit_low = 0xffff;
 	segment->base_low = 0;
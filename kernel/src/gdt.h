@@ -1,6 +1,7 @@
 #ifndef __GDT_H
 #define __GDT_H 1
 
+#include <stdbool.h>
 #include <stdint.h>
 
 enum SEGMENT_PRIVILEGE
@@ -11,7 +12,24 @@ enum SEGMENT_PRIVILEGE
 	PRIVILEGE_LVL_3 = 3,
 };
 
+// GDT entries. The TSS descriptor takes up two of them.
+#define GDT_KERNEL_CODE (1)
+#define GDT_KERNEL_DATA (2)
+#define GDT_USER_CODE (3)
+#define GDT_USER_DATA (4)
+#define GDT_TSS (5)
+#define GDT_ENTRY_COUNT (8)
+
+// Interrupt stack table slot used for double faults so they still get a
+// working stack after a kernel stack overflow.
+#define IST_DOUBLE_FAULT (1)
+
+// Sets up and loads the GDT and TSS of the bootstrap processor.
 void init_gdt(void);
+
+// Sets up and loads the GDT and TSS of an application processor.
+void init_ap_gdt(void);
+
 void write_code_descriptor(uint16_t index, enum SEGMENT_PRIVILEGE privilege, bool conforming);
 void write_data_descriptor(uint16_t index, enum SEGMENT_PRIVILEGE privilege);
 
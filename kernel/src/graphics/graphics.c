@@ -111,7 +111,7 @@ GRAPHICS_CONTEXT *graphics_get_ctx(enum GRAPHICS_BUFFER_COUNT buffer_count,
 		return NULL;
 	}
 
-	GRAPHICS_CONTEXT *ctx = kmalloc(sizeof(GRAPHICS_CONTEXT));
+	GRAPHICS_CONTEXT *ctx = kzalloc(sizeof(GRAPHICS_CONTEXT));
 	if (ctx == NULL) {
 		return NULL;
 	}
@@ -138,10 +138,12 @@ GRAPHICS_CONTEXT *graphics_get_ctx(enum GRAPHICS_BUFFER_COUNT buffer_count,
 	set_stroke(ctx, 0x00ffffff); // white
 	set_line_width(ctx, 4);		 // 4 px
 
-	//  Buffer count init
+	// The first back buffer is cleared below before it is ever shown so it
+	// does not need zeroing.
 	if (buffer_count == DOUBLE) {
 		ctx->buffer0 =
-			kmalloc(ctx->ctx_width * ctx->ctx_height * (_framebuffer.bpp / 8));
+			kmalloc_aligned(ctx->buffer_size, KMALLOC_ALIGN_CACHE_LINE,
+							KMALLOC_NOZERO);
 
 		if (ctx->buffer0 == NULL) {
 			return NULL;
@@ -152,14 +154,17 @@ GRAPHICS_CONTEXT *graphics_get_ctx(enum GRAPHICS_BUFFER_COUNT buffer_count,
 		ctx->buffer = ctx->buffer0;
 	} else if (buffer_count == TRIPLE) {
 		ctx->buffer0 =
-			kmalloc(ctx->ctx_width * ctx->ctx_height * (_framebuffer.bpp / 8));
+			kmalloc_aligned(ctx->buffer_size, KMALLOC_ALIGN_CACHE_LINE,
+							KMALLOC_NOZERO);
 		if (ctx->buffer0 == NULL) {
 			return NULL;
 		}
 
+		// Only the first back buffer gets cleared below so keep this one
+		// zeroed.
 		ctx->buffer1 =
-			kmalloc(ctx->ctx_width * ctx->ctx_height * (_framebuffer.bpp / 8));
-		if (ctx->buffer0 == NULL) {
+			kmalloc_aligned(ctx->buffer_size, KMALLOC_ALIGN_CACHE_LINE, 0);
+		if (ctx->buffer1 == NULL) {
 			return NULL;
 		}
 
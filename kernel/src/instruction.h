@@ -65,10 +65,58 @@ static inline void flush_tlb(void *virtual_address)
 	asm volatile("invlpg (%0)" ::"r"((uintptr_t)virtual_address) : "memory");
 }
 
+// Reads the time stamp counter.
+static inline uint64_t read_tsc(void)
+{
+	uint32_t low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+#define MSR_GS_BASE (0xc0000101)
+
+// Reads a model specific register.
+static inline uint64_t read_msr(uint32_t msr)
+{
+	uint32_t low, high;
+	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+	return ((uint64_t)high << 32) | low;
+}
+
+// Writes a model specific register.
+static inline void write_msr(uint32_t msr, uint64_t value)
+{
+	asm volatile("wrmsr" ::"c"(msr), "a"((uint32_t)value),
+				 "d"((uint32_t)(value >> 32))
+				 : "memory");
+}
+
 static inline void enable_interrupts(void) { asm volatile("sti"); }
 
 static inline void disable_interrupts(void) { asm volatile("cli"); }
 
+#define RFLAGS_IF (1ULL << 9)
+
+// Disables interrupts and returns the previous RFLAGS for
+// `restore_interrupts`.
+static inline uint64_t save_and_disable_interrupts(void)
+{
+	uint64_t flags;
+	asm volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags)::"memory");
+	return flags;
+}
+
+// Re-enables interrupts if they were enabled when the flags were saved.
+static inline void restore_interrupts(uint64_t flags)
+{
+	if (flags & RFLAGS_IF) {
+		asm volatile("sti" ::: "memory");
+	}
+}
+
+// Hints to the CPU that it is in a spin wait loop.
+static inline void cpu_relax(void) { asm volatile("pause" ::: "memory"); }
+
 static inline void enable_sse2()
 {
 	uint64_t cr0 = read_CR0();
@@ -1,4 +1,5 @@
 #include "idt.h"
+#include "gdt.h"
 #include "instruction.h"
 #include "macro.h"
 #include "memory/stack.h"
@@ -94,8 +95,6 @@ extern void isr28();
 extern void isr29();
 extern void isr30();
 
-void load_idt(void);
-
 void init_idt(void)
 {
 	printf(KINFO "Disabling interrupts\n");
@@ -112,6 +111,7 @@ void init_idt(void)
 	set_interrupt_gate(6, (uintptr_t)isr6, 8, 0x8E);
 	set_interrupt_gate(7, (uintptr_t)isr7, 8, 0x8E);
 	set_interrupt_gate(8, (uintptr_t)isr8, 8, 0x8E);
+	set_interrupt_stack(8, IST_DOUBLE_FAULT);
 	set_interrupt_gate(10, (uintptr_t)isr10, 8, 0x8E);
 	set_interrupt_gate(11, (uintptr_t)isr11, 8, 0x8E);
 	set_interrupt_gate(12, (uintptr_t)isr12, 8, 0x8E);
@@ -152,6 +152,11 @@ void set_interrupt_gate(uint16_t index, uintptr_t target,
 	_idt[index].target_offset_high = (target >> 32) & 0xffffffff;
 }
 
+void set_interrupt_stack(uint16_t index, uint8_t ist)
+{
+	_idt[index].ist = ist;
+}
+
 const char *exception_messages[] = {
 	"Division Error",
 	"Debug",
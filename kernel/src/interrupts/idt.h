@@ -4,6 +4,13 @@
 #include <stdint.h>
 
 void init_idt(void);
+
+// Loads the IDT on the executing processor. All processors share one table.
+void load_idt(void);
+
 void set_interrupt_gate(uint16_t index, uintptr_t target, uint16_t target_selector, uint16_t flags);
 
+// Makes the gate switch to the given interrupt stack table slot.
+void set_interrupt_stack(uint16_t index, uint8_t ist);
+
 #endif
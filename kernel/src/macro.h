@@ -5,9 +5,12 @@
 
 #define STRINGIFY(s) #s
 
+#define CACHE_LINE_SIZE (64)
+
 #define NO_RETURN __attribute__((noreturn))
 #define ATTR_PACK __attribute__((__packed__))
 #define ATTR_REQUEST __attribute__((used, section(".requests")))
+#define ATTR_CACHE_ALIGN __attribute__((aligned(CACHE_LINE_SIZE)))
 
 #define KDEBUG BLU "[DEBUG] " RESET
 #define KWARN YEL "[WARN] " RESET
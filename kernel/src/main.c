@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "color.h"
+#include "cpu.h"
 #include "cpuid.h"
 #include "debug.h"
 #include "devices/tty.h"
@@ -16,9 +17,12 @@
 #include "interrupts/idt.h"
 #include "macro.h"
 #include "memory/heap.h"
+#include "memory/heap_stress.h"
 #include "memory/memory.h"
 #include "memory/stack.h"
 #include "panic.h"
+#include "sched/sched_bench.h"
+#include "sched/scheduler.h"
 #include "serial.h"
 #include "string/utility.h"
 #include "type.h"
@@ -37,6 +41,7 @@ void kmain(void)
 		halt();
 	}
 
+	init_cpu();
 	init_serial();
 
 	// Attempt to load debug symbols.
@@ -78,6 +83,11 @@ void kmain(void)
 
 	init_gdt();
 	init_idt();
+	init_scheduler();
+	init_smp();
+
+	heap_stress(cpu_count());
+	sched_bench();
 
 	while (1) {
 		print_memory_layout();
@@ -0,0 +1,62 @@
+#include "arena.h"
+#include "debug.h"
+#include "memory.h"
+#include "pages.h"
+#include "panic.h"
+#include "type.h"
+
+void arena_init(struct ARENA *arena, void *buffer, size_t size)
+{
+	arena->base = (uintptr_t)buffer;
+	arena->size = size;
+	arena->offset = 0;
+	arena->owns_pages = false;
+}
+
+struct ARENA *arena_create(size_t size)
+{
+	size_t total_size = size + sizeof(struct ARENA);
+	size_t page_count = (total_size + PAGE_BYTE_SIZE - 1) / PAGE_BYTE_SIZE;
+
+	void *pages = alloc_pages(page_count);
+	if (pages == NULL) {
+		debug_code(ERROR_INSUFFICIENT_SPACE);
+		return NULL;
+	}
+
+	struct ARENA *arena = pages;
+	arena_init(arena, pages + sizeof(struct ARENA),
+			   page_count * PAGE_BYTE_SIZE - sizeof(struct ARENA));
+	arena->owns_pages = true;
+
+	return arena;
+}
+
+void arena_destroy(struct ARENA *arena)
+{
+	if (!arena->owns_pages) {
+		panicf("Attempt to destroy arena %p which does not own its pages.\n",
+			   arena);
+	}
+
+	free_pages(arena);
+}
+
+void *arena_alloc(struct ARENA *arena, size_t size, size_t alignment)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		panicf("Arena alignment %lu is not a power of two.\n", alignment);
+	}
+
+	uintptr_t address =
+		(arena->base + arena->offset + alignment - 1) & ~(alignment - 1);
+	uintptr_t end = address + size;
+
+	if (end < address || end > arena->base + arena->size) {
+		return NULL;
+	}
+
+	arena->offset = end - arena->base;
+
+	return (void *)address;
+}
@@ -0,0 +1,46 @@
+#ifndef __MEMORY_ARENA_H
+#define __MEMORY_ARENA_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A bump allocator for short lived scratch memory. Allocations are never freed
+// individually. Take a mark before a batch of allocations and reset to it
+// afterwards to release them all at once.
+struct ARENA {
+	uintptr_t base;
+	size_t size;
+	size_t offset;
+	bool owns_pages; /* Memory came from `alloc_pages` */
+};
+
+typedef size_t arena_mark_t;
+
+// Sets up an arena over memory owned by the caller. Useful with static
+// buffers before the page allocator is available.
+void arena_init(struct ARENA *arena, void *buffer, size_t size);
+
+// Creates an arena backed by freshly mapped pages. The arena header lives in
+// the first page. Returns NULL if the pages could not be allocated.
+struct ARENA *arena_create(size_t size);
+
+// Releases the pages of an arena made by `arena_create`.
+void arena_destroy(struct ARENA *arena);
+
+// Allocates memory aligned to a power of two. The memory is not zeroed.
+// Returns NULL if the arena is exhausted.
+void *arena_alloc(struct ARENA *arena, size_t size, size_t alignment);
+
+static inline arena_mark_t arena_mark(const struct ARENA *arena)
+{
+	return arena->offset;
+}
+
+// Releases every allocation made after the mark was taken.
+static inline void arena_reset(struct ARENA *arena, arena_mark_t mark)
+{
+	arena->offset = mark;
+}
+
+#endif
@@ -1,8 +1,13 @@
 #include "../string/utility.h"
+#include "cpu.h"
 #include "debug.h"
+#include "heap.h"
+#include "heap_profile.h"
 #include "macro.h"
 #include "panic.h"
+#include "pages.h"
 #include "physical.h"
+#include "sync/spinlock.h"
 #include "virtual.h"
 #include <stdbool.h>
 #include <stddef.h>
@@ -10,6 +15,37 @@
 
 #define MAX(num1, num2) ((num1 > num2) ? num1 : num2)
 
+// Small allocations are rounded up to a power of two size class starting at
+// 16 bytes. Objects of a size class are cached in per-CPU magazines.
+#define HEAP_SIZE_CLASS_COUNT (7)
+#define HEAP_SIZE_CLASS_NONE (0xffff)
+#define HEAP_MIN_CLASS_SIZE (16ULL)
+#define HEAP_MAX_CLASS_SIZE (HEAP_MIN_CLASS_SIZE << (HEAP_SIZE_CLASS_COUNT - 1))
+
+// Smallest payload worth cleaving off of a free block.
+#define HEAP_MIN_SPLIT_SIZE (16ULL)
+
+// Number of objects a single magazine can hold.
+#define MAGAZINE_SIZE (32)
+
+// Maximum number of full magazines the depot keeps per size class before
+// returning objects to the block heap.
+#define DEPOT_FULL_LIMIT (8)
+
+// The heap grows by at least this much at a time. Once the free space at its
+// end passes the watermark it is trimmed back down to the keep size.
+#define HEAP_EXPANSION_MIN_SIZE (256 * 1024ULL)
+#define HEAP_TRIM_WATERMARK (1024 * 1024ULL)
+#define HEAP_TRIM_KEEP (HEAP_EXPANSION_MIN_SIZE)
+
+// Allocations at or above this size are mapped page by page outside of the heap
+// so they never need physically contiguous memory.
+#define HEAP_LARGE_ALLOCATION_THRESHOLD (64 * 1024ULL)
+
+// DMA allocations bypass the heap and are tracked separately.
+#define DMA_ALLOCATION_MAX (32)
+#define DMA_ADDRESS_LIMIT (0x100000000ULL)
+
 struct HEAP_MEMORY_RANGE {
 	uintptr_t address;
 	size_t size;
@@ -17,18 +53,84 @@ struct HEAP_MEMORY_RANGE {
 
 struct HEAP_BLOCK {
 	size_t length;
-	uint64_t free;
+	uint16_t free;
+	uint16_t zeroed;	 /* Payload is known to be all zero */
+	uint16_t size_class; /* HEAP_SIZE_CLASS_NONE if not a magazine object */
+	uint16_t owner_cpu;	 /* CPU which last allocated the object */
 	struct HEAP_BLOCK *previous;
 	struct HEAP_BLOCK *next;
+	// Free list links. Only valid while the block is free.
 	struct HEAP_BLOCK *next_free;
+	struct HEAP_BLOCK *previous_free;
+};
+_Static_assert(sizeof(struct HEAP_BLOCK) % KMALLOC_ALIGN_MIN == 0);
+
+// A stack of cached objects belonging to a single size class.
+struct MAGAZINE {
+	struct MAGAZINE *next; /* Depot list link */
+	uint64_t rounds;
+	void *objects[MAGAZINE_SIZE];
+};
+
+// Link stored inside the payload of an object freed by a non-owning CPU.
+struct REMOTE_FREE {
+	struct REMOTE_FREE *next;
+};
+
+// Per-CPU object cache. Each CPU holds a loaded and a previous magazine per
+// size class so it can alternate between allocating and freeing without going
+// to the depot.
+struct HEAP_CPU_CACHE {
+	struct MAGAZINE *loaded[HEAP_SIZE_CLASS_COUNT];
+	struct MAGAZINE *previous[HEAP_SIZE_CLASS_COUNT];
+	// Objects freed by other CPUs. Pushed lock free and drained by the owner.
+	struct REMOTE_FREE *remote_free;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t remote_frees;
+} ATTR_CACHE_ALIGN;
+
+// Global exchange of full and empty magazines. Each size class has its own
+// lock so CPUs working on different sizes never contend.
+struct MAGAZINE_DEPOT {
+	struct SPINLOCK lock;
+	struct MAGAZINE *full;
+	struct MAGAZINE *empty;
+	uint64_t full_count;
+	uint64_t empty_count;
+} ATTR_CACHE_ALIGN;
+
+struct DMA_ALLOCATION {
+	virt_addr_t address;
+	phys_addr_t physical_address;
+	size_t size;
 };
 
 static struct HEAP_MEMORY_RANGE _heap = {0};
+static size_t _heap_initial_size = 0;
 static struct HEAP_BLOCK *_root_block = NULL;
 static struct HEAP_BLOCK *_first_free_block = NULL;
 
+static struct HEAP_CPU_CACHE _cpu_caches[MAX_CPUS] = {0};
+static struct MAGAZINE_DEPOT _depot[HEAP_SIZE_CLASS_COUNT] = {0};
+
+static struct DMA_ALLOCATION _dma_allocations[DMA_ALLOCATION_MAX] = {0};
+
+// Locking, outermost first:
+//
+//   per-CPU caches  interrupts disabled, only touched by their own CPU
+//   _depot[].lock   never held while calling into the block heap
+//   _heap_lock      block list, free list, heap size and the DMA table
+//   page, physical and virtual memory locks
+//
+// Every lock is taken with interrupts disabled so the allocator can be used
+// from interrupt handlers.
+static struct SPINLOCK _heap_lock = SPINLOCK_INIT;
+
 void print_heap(void)
 {
+	uint64_t flags = spin_lock_irqsave(&_heap_lock);
+
 	struct HEAP_BLOCK *ptr = _root_block;
 	printf("=======Heap report=======\n");
 	do {
@@ -39,173 +141,985 @@ void print_heap(void)
 			ptr->previous, ptr->next, ptr->next_free);
 		ptr = ptr->next;
 	} while (ptr != NULL);
-}
 
-static void expand_heap(size_t minimum_expansion_size)
-{
-	err_code err = 0;
-
-	size_t new_size = MAX(minimum_expansion_size, _heap.size * 2) + 0x1000;
+	printf("Magazine depot:\n");
+	for (uint64_t i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+		printf("\t%'5llu bytes | Full: %'lu Empty: %'lu\n",
+			   HEAP_MIN_CLASS_SIZE << i, _depot[i].full_count,
+			   _depot[i].empty_count);
+	}
 
-	printf(KDEBUG "Expanding heap by size: %'lu bytes\n", new_size);
+	printf("Per-CPU magazines:\n");
+	for (uint64_t i = 0; i < MAX_CPUS; i++) {
+		struct HEAP_CPU_CACHE *cache = &_cpu_caches[i];
+		if (cache->hits == 0 && cache->misses == 0) {
+			continue;
+		}
 
-	phys_addr_t physical_address = 0;
-	if ((err = allocate_memory(new_size, &physical_address))) {
-		debug_code(err);
-		panicf("Failed to allocate new physical memory to expand heap.\n");
+		printf("\tCPU %2lu | Hits: %'lu Misses: %'lu Remote frees: %'lu\n", i,
+			   cache->hits, cache->misses, cache->remote_frees);
 	}
 
-	virt_addr_t virtual_address = (virt_addr_t)(_heap.address + _heap.size);
-	if (false == map_memory(physical_address, virtual_address, new_size,
-							PAGE_MAP_WRITEABLE)) {
-		panicf("Failed to map new physical memory to expand heap.\n");
-	}
+	printf("DMA allocations:\n");
+	for (uint64_t i = 0; i < DMA_ALLOCATION_MAX; i++) {
+		struct DMA_ALLOCATION *allocation = &_dma_allocations[i];
+		if (allocation->address == NULL) {
+			continue;
+		}
 
-	struct HEAP_BLOCK *last_block = _root_block;
-	while (last_block->next != NULL) {
-		last_block = last_block->next;
+		printf("\t%p Physical: %#018lx Size: %'lu bytes\n",
+			   allocation->address, allocation->physical_address,
+			   allocation->size);
 	}
 
-	if (last_block->free == true) {
-		last_block->length += new_size;
-	} else {
-		panicf("Last heap block is not free. Time to implement this case\n");
-	}
+	spin_unlock_irqrestore(&_heap_lock, flags);
+
+	printf("Page allocations:\n");
+	print_page_allocations();
 }
 
-void *kmalloc(size_t size)
+// Rounds a size up to a multiple of a power of two alignment.
+static inline size_t align_up(size_t value, size_t alignment)
 {
-	// Minimum allocated size is 8 bytes.
-	uint64_t rem = size % 8;
-	size -= rem;
-	if (rem != 0) {
-		size += 8;
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Removes a block from the free list.
+static void free_list_remove(struct HEAP_BLOCK *block)
+{
+	if (block->previous_free != NULL) {
+		block->previous_free->next_free = block->next_free;
+	} else {
+		_first_free_block = block->next_free;
 	}
 
-	// Find a block which is big enough for the requested size
-	struct HEAP_BLOCK *block = _first_free_block;
-	while (block != NULL && block->length < size) {
-		block = block->next_free;
+	if (block->next_free != NULL) {
+		block->next_free->previous_free = block->previous_free;
 	}
 
-	if (block == NULL) {
-		expand_heap(size);
+	block->next_free = NULL;
+	block->previous_free = NULL;
+}
 
-		block = _first_free_block;
-		while (block != NULL && block->length < size) {
-			block = block->next_free;
-		}
+// Puts a new free block in the free list position of an existing one.
+static void free_list_replace(struct HEAP_BLOCK *block,
+							  struct HEAP_BLOCK *replacement)
+{
+	replacement->previous_free = block->previous_free;
+	replacement->next_free = block->next_free;
 
-		if (block == NULL) {
-			panicf("Out of memory");
-		}
+	if (replacement->previous_free != NULL) {
+		replacement->previous_free->next_free = replacement;
+	} else {
+		_first_free_block = replacement;
 	}
 
-	// A free block was found which is exactly as big as needed.
-	if (block->length == size) {
-		block->free = 0;
+	if (replacement->next_free != NULL) {
+		replacement->next_free->previous_free = replacement;
+	}
 
-		if (block == _first_free_block) {
-			_first_free_block = block->next_free;
-		}
+	block->next_free = NULL;
+	block->previous_free = NULL;
+}
 
-		void *ptr = (void *)block + sizeof(struct HEAP_BLOCK);
-		memset(ptr, 0, size);
+// Inserts a block into the free list keeping the list in address order.
+static void free_list_insert(struct HEAP_BLOCK *block)
+{
+	struct HEAP_BLOCK *previous_free = block->previous;
+	while (previous_free != NULL && !previous_free->free) {
+		previous_free = previous_free->previous;
+	}
+
+	block->previous_free = previous_free;
 
-		return ptr;
+	if (previous_free != NULL) {
+		block->next_free = previous_free->next_free;
+		previous_free->next_free = block;
+	} else {
+		block->next_free = _first_free_block;
+		_first_free_block = block;
 	}
 
-	//
-	// A free block was found but it needs subdivided. The extra length will be
-	// "cleaved" off into a new block
-	//
+	if (block->next_free != NULL) {
+		block->next_free->previous_free = block;
+	}
+}
 
-	// TODO check if we have enough space for a valid cleaved block(Don't
-	// overflow)
+// Cleaves everything after the first `size` bytes of a block's payload off
+// into a new block. The new block inherits the free and zeroed state but is not
+// linked into the free list. Returns NULL if the remainder is too small to be
+// worth a block.
+static struct HEAP_BLOCK *cleave_block(struct HEAP_BLOCK *block, size_t size)
+{
+	if (block->length <
+		size + sizeof(struct HEAP_BLOCK) + HEAP_MIN_SPLIT_SIZE) {
+		return NULL;
+	}
 
 	struct HEAP_BLOCK *cleaved_block =
 		((void *)block) + sizeof(struct HEAP_BLOCK) + size;
 	cleaved_block->length = block->length - (sizeof(struct HEAP_BLOCK) + size);
-	cleaved_block->free = 1;
+	cleaved_block->free = block->free;
+	cleaved_block->zeroed = block->zeroed;
+	cleaved_block->size_class = HEAP_SIZE_CLASS_NONE;
+	cleaved_block->owner_cpu = 0;
 	cleaved_block->previous = block;
 	cleaved_block->next = block->next;
-	cleaved_block->next_free = block->next_free;
+	cleaved_block->next_free = NULL;
+	cleaved_block->previous_free = NULL;
 
 	if (cleaved_block->next != NULL) {
 		cleaved_block->next->previous = cleaved_block;
 	}
 
 	block->length = size;
-	block->free = 0;
 	block->next = cleaved_block;
-	block->next_free = cleaved_block;
 
-	if (block->previous != NULL) {
-		block->previous->next_free = cleaved_block;
+	return cleaved_block;
+}
+
+// Unmaps the heap pages in a range and returns their frames to the physical
+// allocator.
+static void release_heap_pages(uintptr_t address, size_t size)
+{
+	err_code err = 0;
+
+	for (uintptr_t offset = 0; offset < size; offset += PAGE_BYTE_SIZE) {
+		virt_addr_t page = (virt_addr_t)(address + offset);
+		phys_addr_t physical_address = 0;
+
+		if (!translate_address(page, &physical_address)) {
+			continue;
+		}
+
+		unmap_memory(page, PAGE_BYTE_SIZE);
+
+		if ((err = release_memory(physical_address, PAGE_BYTE_SIZE))) {
+			debug_code(err);
+		}
+	}
+}
+
+// Grows the heap by mapping individual page frames after its end, so no
+// physically contiguous memory is needed. Returns false if physical memory is
+// exhausted, in which case the heap is left unchanged.
+static bool expand_heap(size_t minimum_expansion_size)
+{
+	err_code err = 0;
+
+	size_t expansion_size = align_up(
+		MAX(minimum_expansion_size, HEAP_EXPANSION_MIN_SIZE), PAGE_BYTE_SIZE);
+	uintptr_t heap_end = _heap.address + _heap.size;
+
+	printf(KDEBUG "Expanding heap by size: %'lu bytes\n", expansion_size);
+
+	for (uintptr_t offset = 0; offset < expansion_size;
+		 offset += PAGE_BYTE_SIZE) {
+		phys_addr_t physical_address = 0;
+
+		if ((err = allocate_page(&physical_address))) {
+			debug_code(err);
+			release_heap_pages(heap_end, offset);
+			return false;
+		}
+
+		if (false == map_memory(physical_address,
+								(virt_addr_t)(heap_end + offset),
+								PAGE_BYTE_SIZE, PAGE_MAP_WRITEABLE)) {
+			release_memory(physical_address, PAGE_BYTE_SIZE);
+			release_heap_pages(heap_end, offset);
+			return false;
+		}
+	}
+
+	// Fresh memory is zeroed once here so `kzalloc` can skip zeroing anything
+	// carved out of it.
+	memset((void *)heap_end, 0, expansion_size);
+
+	_heap.size += expansion_size;
+
+	struct HEAP_BLOCK *last_block = _root_block;
+	while (last_block->next != NULL) {
+		last_block = last_block->next;
 	}
 
-	if (cleaved_block < _first_free_block || block == _first_free_block) {
-		_first_free_block = cleaved_block;
+	if (last_block->free) {
+		// The new pages are zero so a zeroed tail stays zeroed.
+		last_block->length += expansion_size;
+		return true;
 	}
 
-	void *ptr = (void *)block + sizeof(struct HEAP_BLOCK);
-	memset(ptr, 0, size);
+	struct HEAP_BLOCK *new_block = (struct HEAP_BLOCK *)heap_end;
+	new_block->length = expansion_size - sizeof(struct HEAP_BLOCK);
+	new_block->free = 1;
+	new_block->zeroed = 1;
+	new_block->size_class = HEAP_SIZE_CLASS_NONE;
+	new_block->owner_cpu = 0;
+	new_block->previous = last_block;
+	new_block->next = NULL;
+	new_block->next_free = NULL;
+	new_block->previous_free = NULL;
 
-	return ptr;
+	last_block->next = new_block;
+	free_list_insert(new_block);
+
+	return true;
 }
 
-void kfree(void *ptr)
+// Shrinks the heap once the free block at its end grows past
+// `HEAP_TRIM_WATERMARK`. Pages past `HEAP_TRIM_KEEP` bytes of the block are
+// returned to the physical allocator. The heap never shrinks below its initial
+// size.
+static void trim_heap(struct HEAP_BLOCK *last_block)
 {
-	if (ptr == NULL) {
-		panicf("Attempt to free null pointer.\n");
+	if (!last_block->free || last_block->next != NULL ||
+		last_block->length <= HEAP_TRIM_WATERMARK) {
 		return;
 	}
 
-	struct HEAP_BLOCK *block = ptr - sizeof(struct HEAP_BLOCK);
-	block->free = 1;
+	uintptr_t heap_end = _heap.address + _heap.size;
+	uintptr_t new_heap_end =
+		align_up((uintptr_t)last_block + sizeof(struct HEAP_BLOCK) +
+					 HEAP_TRIM_KEEP,
+				 PAGE_BYTE_SIZE);
+	new_heap_end = MAX(new_heap_end, _heap.address + _heap_initial_size);
 
-	if (block < _first_free_block) {
-		_first_free_block = block;
+	if (new_heap_end >= heap_end) {
+		return;
 	}
 
-	if (block->previous != NULL) {
-		block->previous->next_free = block;
+	release_heap_pages(new_heap_end, heap_end - new_heap_end);
+
+	last_block->length -= heap_end - new_heap_end;
+	_heap.size = new_heap_end - _heap.address;
+}
+
+// Finds the first free block which can hold `size` bytes at the requested
+// alignment. The distance from the start of the block's payload to the aligned
+// payload is given through `lead_output`. A non zero lead is always big enough
+// to leave a valid free block in front of the aligned one.
+static struct HEAP_BLOCK *find_free_block(size_t size, size_t alignment,
+										  size_t *lead_output)
+{
+	struct HEAP_BLOCK *block = _first_free_block;
+	while (block != NULL) {
+		uintptr_t payload = (uintptr_t)block + sizeof(struct HEAP_BLOCK);
+		uintptr_t aligned = align_up(payload, alignment);
+		if (aligned != payload) {
+			aligned = align_up(payload + sizeof(struct HEAP_BLOCK) +
+								   HEAP_MIN_SPLIT_SIZE,
+							   alignment);
+		}
+
+		size_t lead = aligned - payload;
+		if (block->length >= lead + size) {
+			*lead_output = lead;
+			return block;
+		}
+
+		block = block->next_free;
+	}
+
+	return NULL;
+}
+
+// Allocates a block from the block heap. The size must already be rounded to
+// `KMALLOC_ALIGN_MIN` bytes. Returns NULL if the heap is exhausted and the
+// `KMALLOC_ATOMIC` flag forbids growing it.
+static struct HEAP_BLOCK *alloc_block(size_t size, size_t alignment,
+									  uint32_t flags)
+{
+	uint64_t irq_flags = spin_lock_irqsave(&_heap_lock);
+
+	size_t lead = 0;
+	struct HEAP_BLOCK *block = find_free_block(size, alignment, &lead);
+	if (block == NULL) {
+		if (flags & KMALLOC_ATOMIC) {
+			spin_unlock_irqrestore(&_heap_lock, irq_flags);
+			return NULL;
+		}
+
+		if (!expand_heap(size + alignment + sizeof(struct HEAP_BLOCK) +
+						 HEAP_MIN_SPLIT_SIZE)) {
+			panicf("Out of memory");
+		}
+
+		block = find_free_block(size, alignment, &lead);
+		if (block == NULL) {
+			panicf("Out of memory");
+		}
+	}
+
+	if (lead != 0) {
+		// Leave the unaligned front of the block free and continue with the
+		// aligned remainder.
+		struct HEAP_BLOCK *aligned_block =
+			cleave_block(block, lead - sizeof(struct HEAP_BLOCK));
+		free_list_insert(aligned_block);
+		block = aligned_block;
+	}
+
+	struct HEAP_BLOCK *cleaved_block = cleave_block(block, size);
+	if (cleaved_block != NULL) {
+		free_list_replace(block, cleaved_block);
+	} else {
+		// The remainder is too small to be useful so hand out the whole block.
+		free_list_remove(block);
+	}
+
+	block->free = 0;
+	block->size_class = HEAP_SIZE_CLASS_NONE;
+	block->owner_cpu = cpu_index();
+
+	spin_unlock_irqrestore(&_heap_lock, irq_flags);
+
+	return block;
+}
+
+// Returns a block to the block heap, merging it with free neighbours. The
+// caller must hold `_heap_lock`.
+static void free_block_locked(struct HEAP_BLOCK *block)
+{
+	if (block->free) {
+		panicf("Double free of heap block %p.\n", block);
 	}
 
+	block->free = 1;
+	block->zeroed = 0;
+	block->size_class = HEAP_SIZE_CLASS_NONE;
+
 	// Maybe absorb the next block if its free
 	struct HEAP_BLOCK *next_block = block->next;
 	if (next_block != NULL && next_block->free) {
-		if (next_block->next != NULL) {
-			next_block->next->previous = block;
-		}
+		free_list_remove(next_block);
 
 		block->length =
 			block->length + sizeof(struct HEAP_BLOCK) + next_block->length;
 		block->next = next_block->next;
-		block->next_free = next_block->next_free;
 
-		if (block < _first_free_block) {
-			_first_free_block = block;
+		if (block->next != NULL) {
+			block->next->previous = block;
 		}
 	}
 
-	// Maybe merge with previous block
+	// Maybe merge with previous block. The previous block is already in the
+	// free list so there is nothing left to link.
 	struct HEAP_BLOCK *previous_block = block->previous;
 	if (previous_block != NULL && previous_block->free) {
 		previous_block->length =
 			previous_block->length + sizeof(struct HEAP_BLOCK) + block->length;
-		previous_block->free = 1;
+		previous_block->zeroed = 0;
 		previous_block->next = block->next;
-		previous_block->next_free = block->next_free;
 
 		if (block->next != NULL) {
 			block->next->previous = previous_block;
 		}
 
-		if (previous_block < _first_free_block) {
-			_first_free_block = previous_block;
+		trim_heap(previous_block);
+		return;
+	}
+
+	free_list_insert(block);
+	trim_heap(block);
+}
+
+static void free_block(struct HEAP_BLOCK *block)
+{
+	uint64_t flags = spin_lock_irqsave(&_heap_lock);
+	free_block_locked(block);
+	spin_unlock_irqrestore(&_heap_lock, flags);
+}
+
+// Gets the size class index for a small allocation size.
+static inline uint16_t size_to_class(size_t size)
+{
+	uint16_t size_class = 0;
+	while ((HEAP_MIN_CLASS_SIZE << size_class) < size) {
+		size_class++;
+	}
+
+	return size_class;
+}
+
+// Gets a magazine with no rounds from the depot or allocates a new one.
+// Returns NULL if no magazine can be had without growing the heap.
+static struct MAGAZINE *magazine_empty(uint16_t size_class)
+{
+	struct MAGAZINE_DEPOT *depot = &_depot[size_class];
+
+	uint64_t flags = spin_lock_irqsave(&depot->lock);
+	struct MAGAZINE *magazine = depot->empty;
+	if (magazine != NULL) {
+		depot->empty = magazine->next;
+		depot->empty_count--;
+	}
+	spin_unlock_irqrestore(&depot->lock, flags);
+
+	if (magazine == NULL) {
+		struct HEAP_BLOCK *block = alloc_block(
+			align_up(sizeof(struct MAGAZINE), KMALLOC_ALIGN_MIN),
+			KMALLOC_ALIGN_MIN, KMALLOC_ATOMIC);
+		if (block == NULL) {
+			return NULL;
 		}
+
+		magazine = (void *)block + sizeof(struct HEAP_BLOCK);
 	}
+
+	magazine->next = NULL;
+	magazine->rounds = 0;
+
+	return magazine;
+}
+
+// Gives a magazine back to the depot.
+static void depot_put(uint16_t size_class, struct MAGAZINE *magazine)
+{
+	struct MAGAZINE_DEPOT *depot = &_depot[size_class];
+
+	uint64_t flags = spin_lock_irqsave(&depot->lock);
+
+	if (magazine->rounds != 0 && depot->full_count < DEPOT_FULL_LIMIT) {
+		magazine->next = depot->full;
+		depot->full = magazine;
+		depot->full_count++;
+
+		spin_unlock_irqrestore(&depot->lock, flags);
+		return;
+	}
+
+	spin_unlock_irqrestore(&depot->lock, flags);
+
+	if (magazine->rounds != 0) {
+		// The depot is holding plenty already. Return the objects to the block
+		// heap so the memory can be reused by other sizes.
+		for (uint64_t i = 0; i < magazine->rounds; i++) {
+			free_block(magazine->objects[i] - sizeof(struct HEAP_BLOCK));
+		}
+
+		magazine->rounds = 0;
+	}
+
+	flags = spin_lock_irqsave(&depot->lock);
+	magazine->next = depot->empty;
+	depot->empty = magazine;
+	depot->empty_count++;
+	spin_unlock_irqrestore(&depot->lock, flags);
+}
+
+// Takes a full magazine from the depot. Returns NULL if none are available.
+static struct MAGAZINE *depot_get_full(uint16_t size_class)
+{
+	struct MAGAZINE_DEPOT *depot = &_depot[size_class];
+
+	uint64_t flags = spin_lock_irqsave(&depot->lock);
+
+	struct MAGAZINE *magazine = depot->full;
+	if (magazine != NULL) {
+		depot->full = magazine->next;
+		depot->full_count--;
+		magazine->next = NULL;
+	}
+
+	spin_unlock_irqrestore(&depot->lock, flags);
+
+	return magazine;
+}
+
+// Caches an object owned by the executing CPU in one of its magazines. If no
+// magazine space can be found the object goes back to the block heap.
+static void magazine_put(struct HEAP_CPU_CACHE *cache, struct HEAP_BLOCK *block)
+{
+	uint16_t size_class = block->size_class;
+
+	if (cache->loaded[size_class] == NULL) {
+		cache->loaded[size_class] = magazine_empty(size_class);
+	}
+
+	struct MAGAZINE *loaded = cache->loaded[size_class];
+	if (loaded != NULL && loaded->rounds == MAGAZINE_SIZE) {
+		struct MAGAZINE *previous = cache->previous[size_class];
+
+		if (previous != NULL && previous->rounds == 0) {
+			// The previous magazine is empty so swap it in.
+			cache->previous[size_class] = loaded;
+			cache->loaded[size_class] = previous;
+		} else {
+			// Hand the previous magazine to the depot and load an empty one.
+			struct MAGAZINE *empty = magazine_empty(size_class);
+			if (empty != NULL) {
+				if (previous != NULL) {
+					depot_put(size_class, previous);
+				}
+
+				cache->previous[size_class] = loaded;
+				cache->loaded[size_class] = empty;
+			}
+		}
+
+		loaded = cache->loaded[size_class];
+	}
+
+	if (loaded == NULL || loaded->rounds == MAGAZINE_SIZE) {
+		free_block(block);
+		return;
+	}
+
+	loaded->objects[loaded->rounds++] =
+		(void *)block + sizeof(struct HEAP_BLOCK);
+}
+
+// Moves objects other CPUs have freed on behalf of this CPU into its
+// magazines. The whole list is claimed at once so the owner drains it as a
+// single batch.
+static void drain_remote_frees(struct HEAP_CPU_CACHE *cache)
+{
+	if (__atomic_load_n(&cache->remote_free, __ATOMIC_RELAXED) == NULL) {
+		return;
+	}
+
+	struct REMOTE_FREE *node =
+		__atomic_exchange_n(&cache->remote_free, NULL, __ATOMIC_ACQUIRE);
+
+	while (node != NULL) {
+		struct REMOTE_FREE *next = node->next;
+		magazine_put(cache, (void *)node - sizeof(struct HEAP_BLOCK));
+		node = next;
+	}
+}
+
+// Pushes an object onto the remote free list of the CPU that owns it.
+static void remote_free_push(struct HEAP_CPU_CACHE *owner,
+							 struct HEAP_BLOCK *block)
+{
+	struct REMOTE_FREE *node = (void *)block + sizeof(struct HEAP_BLOCK);
+	struct REMOTE_FREE *head =
+		__atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+
+	do {
+		node->next = head;
+	} while (!__atomic_compare_exchange_n(&owner->remote_free, &head, node,
+										  true, __ATOMIC_RELEASE,
+										  __ATOMIC_RELAXED));
+}
+
+// Allocates an object of a size class from the executing CPU's magazines,
+// falling back to the depot and then to the block heap.
+static struct HEAP_BLOCK *magazine_alloc(uint16_t size_class, uint32_t flags)
+{
+	// The cache belongs to this CPU alone, so keeping interrupts off is all it
+	// takes to stop an interrupt handler from seeing it half updated.
+	uint64_t irq_flags = save_and_disable_interrupts();
+
+	uint32_t cpu = cpu_index();
+	struct HEAP_CPU_CACHE *cache = &_cpu_caches[cpu];
+
+	drain_remote_frees(cache);
+
+	struct MAGAZINE *loaded = cache->loaded[size_class];
+	if (loaded == NULL || loaded->rounds == 0) {
+		struct MAGAZINE *previous = cache->previous[size_class];
+
+		if (previous != NULL && previous->rounds > 0) {
+			// The previous magazine has rounds so swap it in.
+			cache->previous[size_class] = loaded;
+			cache->loaded[size_class] = previous;
+		} else {
+			struct MAGAZINE *full = depot_get_full(size_class);
+
+			if (full == NULL) {
+				// Nothing cached anywhere. Go to the block heap.
+				cache->misses++;
+				restore_interrupts(irq_flags);
+
+				struct HEAP_BLOCK *block =
+					alloc_block(HEAP_MIN_CLASS_SIZE << size_class,
+								KMALLOC_ALIGN_MIN, flags);
+				if (block != NULL) {
+					block->size_class = size_class;
+				}
+
+				return block;
+			}
+
+			if (previous != NULL) {
+				depot_put(size_class, previous);
+			}
+
+			cache->previous[size_class] = loaded;
+			cache->loaded[size_class] = full;
+		}
+
+		loaded = cache->loaded[size_class];
+	}
+
+	cache->hits++;
+
+	struct HEAP_BLOCK *block =
+		loaded->objects[--loaded->rounds] - sizeof(struct HEAP_BLOCK);
+	block->owner_cpu = cpu;
+
+	restore_interrupts(irq_flags);
+
+	return block;
+}
+
+// Frees a size class object. Objects owned by another CPU are queued on that
+// CPU's remote free list instead of touching its magazines.
+static void magazine_free(struct HEAP_BLOCK *block)
+{
+	uint64_t irq_flags = save_and_disable_interrupts();
+
+	uint32_t cpu = cpu_index();
+
+	if (block->owner_cpu != cpu) {
+		struct HEAP_CPU_CACHE *owner = &_cpu_caches[block->owner_cpu];
+		__atomic_fetch_add(&owner->remote_frees, 1, __ATOMIC_RELAXED);
+		remote_free_push(owner, block);
+	} else {
+		struct HEAP_CPU_CACHE *cache = &_cpu_caches[cpu];
+
+		drain_remote_frees(cache);
+		magazine_put(cache, block);
+	}
+
+	restore_interrupts(irq_flags);
+}
+
+// Allocates physically contiguous pages below 4 GiB for devices which can only
+// address 32 bits. The pages are mapped at their HHDM address.
+static void *dma_alloc(size_t size, size_t alignment, uint32_t flags)
+{
+	err_code err = 0;
+
+	if (alignment > PAGE_BYTE_SIZE) {
+		debug_code(ERROR_UNSUPPORTED);
+		return NULL;
+	}
+
+	size = align_up(size, PAGE_BYTE_SIZE);
+
+	phys_addr_t physical_address = 0;
+	if ((err = allocate_memory(size, &physical_address))) {
+		debug_code(err);
+		return NULL;
+	}
+
+	if (physical_address + size > DMA_ADDRESS_LIMIT) {
+		release_memory(physical_address, size);
+		debug_code(ERROR_OUT_OF_BOUNDS);
+		return NULL;
+	}
+
+	virt_addr_t virtual_address = phys_to_virt(physical_address);
+	if (map_memory(physical_address, virtual_address, size,
+				   PAGE_MAP_WRITEABLE) == false) {
+		unmap_memory(virtual_address, size);
+		release_memory(physical_address, size);
+		return NULL;
+	}
+
+	struct DMA_ALLOCATION *allocation = NULL;
+
+	uint64_t irq_flags = spin_lock_irqsave(&_heap_lock);
+	for (uint64_t i = 0; i < DMA_ALLOCATION_MAX; i++) {
+		if (_dma_allocations[i].address == NULL) {
+			allocation = &_dma_allocations[i];
+			allocation->address = virtual_address;
+			allocation->physical_address = physical_address;
+			allocation->size = size;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&_heap_lock, irq_flags);
+
+	if (allocation == NULL) {
+		unmap_memory(virtual_address, size);
+		release_memory(physical_address, size);
+		debug_code(ERROR_INSUFFICIENT_SPACE);
+		return NULL;
+	}
+
+	if (!(flags & KMALLOC_NOZERO)) {
+		memset(virtual_address, 0, size);
+	}
+
+	return virtual_address;
+}
+
+// Finds the DMA allocation for a pointer. Returns NULL if it is not one.
+static struct DMA_ALLOCATION *dma_allocation(void *ptr)
+{
+	struct DMA_ALLOCATION *allocation = NULL;
+
+	uint64_t flags = spin_lock_irqsave(&_heap_lock);
+	for (uint64_t i = 0; i < DMA_ALLOCATION_MAX; i++) {
+		if (_dma_allocations[i].address == ptr) {
+			allocation = &_dma_allocations[i];
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&_heap_lock, flags);
+
+	return allocation;
+}
+
+static void dma_free(struct DMA_ALLOCATION *allocation)
+{
+	err_code err = 0;
+
+	// Empty the slot first so the memory is never reachable through the table
+	// once it has been released.
+	uint64_t flags = spin_lock_irqsave(&_heap_lock);
+	struct DMA_ALLOCATION released = *allocation;
+	allocation->address = NULL;
+	allocation->physical_address = 0;
+	allocation->size = 0;
+	spin_unlock_irqrestore(&_heap_lock, flags);
+
+	unmap_memory(released.address, released.size);
+
+	if ((err = release_memory(released.physical_address, released.size))) {
+		debug_code(err);
+	}
+}
+
+// Maps fresh pages for a large allocation. Frames come straight from the
+// physical allocator so they are zeroed here unless the caller opted out.
+static void *large_alloc(size_t size, uint32_t flags)
+{
+	size_t page_count = align_up(size, PAGE_BYTE_SIZE) / PAGE_BYTE_SIZE;
+
+	void *ptr = alloc_pages(page_count);
+	if (ptr == NULL) {
+		if (flags & KMALLOC_ATOMIC) {
+			return NULL;
+		}
+
+		panicf("Out of memory");
+	}
+
+	if (!(flags & KMALLOC_NOZERO)) {
+		memset(ptr, 0, size);
+	}
+
+	return ptr;
+}
+
+static void *heap_alloc(size_t size, size_t alignment, uint32_t flags)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		panicf("Allocation alignment %lu is not a power of two.\n", alignment);
+	}
+
+	if (flags & KMALLOC_DMA) {
+		return dma_alloc(size, alignment, flags);
+	}
+
+	if (size >= HEAP_LARGE_ALLOCATION_THRESHOLD &&
+		alignment <= KMALLOC_ALIGN_PAGE) {
+		return large_alloc(size, flags);
+	}
+
+	alignment = MAX(alignment, KMALLOC_ALIGN_MIN);
+
+	struct HEAP_BLOCK *block = NULL;
+	if (size <= HEAP_MAX_CLASS_SIZE && alignment == KMALLOC_ALIGN_MIN) {
+		block = magazine_alloc(size_to_class(size), flags);
+	} else {
+		block =
+			alloc_block(align_up(size, KMALLOC_ALIGN_MIN), alignment, flags);
+	}
+
+	if (block == NULL) {
+		return NULL;
+	}
+
+	void *ptr = (void *)block + sizeof(struct HEAP_BLOCK);
+
+	if (!(flags & KMALLOC_NOZERO) && !block->zeroed) {
+		memset(ptr, 0, size);
+	}
+
+	// From here on the owner is free to scribble on it.
+	block->zeroed = 0;
+
+	return ptr;
+}
+
+static void heap_free(void *ptr);
+
+// Moves an allocation to a new block of the given size.
+static void *krealloc_move(void *ptr, size_t old_size, size_t size,
+						   uint32_t flags)
+{
+	void *new_ptr = heap_alloc(size, KMALLOC_ALIGN_MIN, flags | KMALLOC_NOZERO);
+	if (new_ptr == NULL) {
+		return NULL;
+	}
+
+	memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+	heap_free(ptr);
+
+	return new_ptr;
+}
+
+static void *heap_realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL) {
+		return heap_alloc(size, KMALLOC_ALIGN_MIN, KMALLOC_NOZERO);
+	}
+
+	if (size == 0) {
+		heap_free(ptr);
+		return NULL;
+	}
+
+	struct DMA_ALLOCATION *allocation = dma_allocation(ptr);
+	if (allocation != NULL) {
+		return krealloc_move(ptr, allocation->size, size, KMALLOC_DMA);
+	}
+
+	if (is_page_allocation(ptr)) {
+		size_t page_size = page_allocation_size(ptr);
+		if (size <= page_size) {
+			return ptr;
+		}
+
+		return krealloc_move(ptr, page_size, size, 0);
+	}
+
+	struct HEAP_BLOCK *block = ptr - sizeof(struct HEAP_BLOCK);
+
+	if (block->size_class != HEAP_SIZE_CLASS_NONE) {
+		size_t class_size = HEAP_MIN_CLASS_SIZE << block->size_class;
+		if (size <= class_size) {
+			return ptr;
+		}
+
+		return krealloc_move(ptr, class_size, size, 0);
+	}
+
+	size = align_up(size, KMALLOC_ALIGN_MIN);
+
+	uint64_t flags = spin_lock_irqsave(&_heap_lock);
+
+	// Grow in place by absorbing the next block if it is free and big enough.
+	struct HEAP_BLOCK *next_block = block->next;
+	if (size > block->length && next_block != NULL && next_block->free &&
+		block->length + sizeof(struct HEAP_BLOCK) + next_block->length >=
+			size) {
+		free_list_remove(next_block);
+
+		block->length += sizeof(struct HEAP_BLOCK) + next_block->length;
+		block->next = next_block->next;
+
+		if (block->next != NULL) {
+			block->next->previous = block;
+		}
+	}
+
+	if (size > block->length) {
+		size_t length = block->length;
+		spin_unlock_irqrestore(&_heap_lock, flags);
+
+		return krealloc_move(ptr, length, size, 0);
+	}
+
+	// Give any excess back to the heap.
+	struct HEAP_BLOCK *cleaved_block = cleave_block(block, size);
+	if (cleaved_block != NULL) {
+		free_block_locked(cleaved_block);
+	}
+
+	spin_unlock_irqrestore(&_heap_lock, flags);
+
+	return ptr;
+}
+
+static void heap_free(void *ptr)
+{
+	if (ptr == NULL) {
+		panicf("Attempt to free null pointer.\n");
+		return;
+	}
+
+	if ((uintptr_t)ptr < _heap.address ||
+		(uintptr_t)ptr >= _heap.address + _heap.size) {
+		if (is_page_allocation(ptr)) {
+			free_pages(ptr);
+			return;
+		}
+
+		struct DMA_ALLOCATION *allocation = dma_allocation(ptr);
+		if (allocation == NULL) {
+			panicf("Attempt to free %p which is not a heap pointer.\n", ptr);
+		}
+
+		dma_free(allocation);
+		return;
+	}
+
+	struct HEAP_BLOCK *block = ptr - sizeof(struct HEAP_BLOCK);
+
+	if (block->size_class != HEAP_SIZE_CLASS_NONE) {
+		magazine_free(block);
+		return;
+	}
+
+	free_block(block);
+}
+
+// The public entry points only add profiling. Each takes the return address
+// itself so the profiler attributes memory to the real caller.
+
+void *kmalloc_aligned(size_t size, size_t alignment, uint32_t flags)
+{
+	void *ptr = heap_alloc(size, alignment, flags);
+	heap_profile_alloc(ptr, size, __builtin_return_address(0));
+	return ptr;
+}
+
+void *kmalloc_flags(size_t size, uint32_t flags)
+{
+	void *ptr = heap_alloc(size, KMALLOC_ALIGN_MIN, flags);
+	heap_profile_alloc(ptr, size, __builtin_return_address(0));
+	return ptr;
+}
+
+void *kmalloc(size_t size)
+{
+	void *ptr = heap_alloc(size, KMALLOC_ALIGN_MIN, KMALLOC_NOZERO);
+	heap_profile_alloc(ptr, size, __builtin_return_address(0));
+	return ptr;
+}
+
+void *kzalloc(size_t size)
+{
+	void *ptr = heap_alloc(size, KMALLOC_ALIGN_MIN, 0);
+	heap_profile_alloc(ptr, size, __builtin_return_address(0));
+	return ptr;
+}
+
+void *krealloc(void *ptr, size_t size)
+{
+	void *new_ptr = heap_realloc(ptr, size);
+
+	// Profiled as a free of the old allocation and a new allocation, even when
+	// it was resized in place.
+	if (new_ptr != NULL || size == 0) {
+		heap_profile_free(ptr, __builtin_return_address(0));
+	}
+
+	heap_profile_alloc(new_ptr, size, __builtin_return_address(0));
+
+	return new_ptr;
+}
+
+void kfree(void *ptr)
+{
+	heap_free(ptr);
+	heap_profile_free(ptr, __builtin_return_address(0));
 }
 
 void init_heap(void *heap_address, size_t size)
@@ -229,53 +1143,139 @@ void init_heap(void *heap_address, size_t size)
 
 	_heap.address = (uintptr_t)heap_address;
 	_heap.size = size;
+	_heap_initial_size = size;
+
+	memset(heap_address, 0, size);
 
 	_root_block = (struct HEAP_BLOCK *)heap_address;
 
 	_root_block->length = size - sizeof(struct HEAP_BLOCK);
 	_root_block->free = 1;
+	_root_block->zeroed = 1;
+	_root_block->size_class = HEAP_SIZE_CLASS_NONE;
+	_root_block->owner_cpu = 0;
 	_root_block->next = NULL;
 	_root_block->previous = NULL;
 	_root_block->next_free = NULL;
+	_root_block->previous_free = NULL;
 
 	_first_free_block = _root_block;
 
 	printf(KOK "Kernel heap is ready\n");
+}
 
-	//
-	// Heap test code
-	//
+// Magazines of other CPUs are read without stopping them, so the cached object
+// count is only a snapshot while they are allocating.
+void heap_stats(struct HEAP_STATS *stats)
+{
+	memset(stats, 0, sizeof(struct HEAP_STATS));
+
+	uint64_t flags = spin_lock_irqsave(&_heap_lock);
 
-	// print_heap();
+	stats->heap_size = _heap.size;
 
-	// void *ptr1 = kmalloc(100);
-	// if (ptr1 == NULL)
-	// 	printf("Malloc error!\n");
+	for (struct HEAP_BLOCK *block = _root_block; block != NULL;
+		 block = block->next) {
+		if (block->free) {
+			stats->free_blocks++;
+			stats->free_bytes += block->length;
+			stats->largest_free_block =
+				MAX(stats->largest_free_block, block->length);
+		} else {
+			stats->used_blocks++;
+		}
+	}
+
+	spin_unlock_irqrestore(&_heap_lock, flags);
+
+	for (uint64_t i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+		flags = spin_lock_irqsave(&_depot[i].lock);
+		for (struct MAGAZINE *magazine = _depot[i].full; magazine != NULL;
+			 magazine = magazine->next) {
+			stats->cached_objects += magazine->rounds;
+		}
+		spin_unlock_irqrestore(&_depot[i].lock, flags);
 
-	// void *ptr2 = kmalloc(490);
-	// if (ptr2 == NULL)
-	// 	printf("Malloc error!\n");
+		for (uint64_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+			struct HEAP_CPU_CACHE *cache = &_cpu_caches[cpu];
 
-	// void *ptr3 = kmalloc(10);
-	// if (ptr3 == NULL)
-	// 	printf("Malloc error!\n");
+			if (cache->loaded[i] != NULL) {
+				stats->cached_objects += cache->loaded[i]->rounds;
+			}
 
-	// kfree(ptr2);
+			if (cache->previous[i] != NULL) {
+				stats->cached_objects += cache->previous[i]->rounds;
+			}
+		}
+	}
+}
 
-	// ptr2 = kmalloc(490);
-	// if (ptr2 == NULL)
-	// 	printf("Malloc error!\n");
+static bool heap_validate_locked(void)
+{
+	struct HEAP_BLOCK *previous_block = NULL;
+	struct HEAP_BLOCK *expected_free = _first_free_block;
+	struct HEAP_BLOCK *previous_free = NULL;
 
-	// // void *ptr4 = kmalloc(89);
-	// // if (ptr4 == NULL)
-	// // 	printf("Malloc error!\n");
+	for (struct HEAP_BLOCK *block = _root_block; block != NULL;
+		 block = block->next) {
+		if (block->previous != previous_block) {
+			printf(KERROR "Heap block %p has a broken previous link\n", block);
+			return false;
+		}
 
-	// print_heap();
+		uintptr_t block_end =
+			(uintptr_t)block + sizeof(struct HEAP_BLOCK) + block->length;
+		if (block->next != NULL && (uintptr_t)block->next != block_end) {
+			printf(KERROR "Heap block %p is not followed by its next block\n",
+				   block);
+			return false;
+		}
 
-	// kfree(ptr3);
-	// kfree(ptr1);
-	// kfree(ptr2);
-	// // kfree(ptr4);
+		if (block->next == NULL && block_end != _heap.address + _heap.size) {
+			printf(KERROR "Last heap block %p does not end the heap\n", block);
+			return false;
+		}
+
+		if (block->free) {
+			if (block->next != NULL && block->next->free) {
+				printf(KERROR "Free heap block %p was not coalesced\n", block);
+				return false;
+			}
+
+			if (block->size_class != HEAP_SIZE_CLASS_NONE) {
+				printf(KERROR "Free heap block %p has a size class\n", block);
+				return false;
+			}
+
+			// The free list is address ordered so it has to match the walk.
+			if (block != expected_free ||
+				block->previous_free != previous_free) {
+				printf(KERROR "Free list does not match heap block %p\n",
+					   block);
+				return false;
+			}
+
+			previous_free = block;
+			expected_free = block->next_free;
+		}
+
+		previous_block = block;
+	}
+
+	if (expected_free != NULL) {
+		printf(KERROR "Free list holds %p which is not in the heap\n",
+			   expected_free);
+		return false;
+	}
+
+	return true;
+}
+
+bool heap_validate(void)
+{
+	uint64_t flags = spin_lock_irqsave(&_heap_lock);
+	bool valid = heap_validate_locked();
+	spin_unlock_irqrestore(&_heap_lock, flags);
 
-	// print_heap();
+	return valid;
 }
@@ -1,12 +1,58 @@
 #ifndef __MEMORY_HEAP_H
 #define __MEMORY_HEAP_H 1
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+// Common alignments for `kmalloc_aligned`. Every allocation is at least
+// `KMALLOC_ALIGN_MIN` aligned which is enough for SSE.
+#define KMALLOC_ALIGN_MIN (16)
+#define KMALLOC_ALIGN_SIMD (32)
+#define KMALLOC_ALIGN_CACHE_LINE (64)
+#define KMALLOC_ALIGN_PAGE (4096)
+
+enum KMALLOC_FLAGS {
+	KMALLOC_NOZERO = 1,		 /* Caller initializes the memory itself */
+	KMALLOC_ATOMIC = 1 << 1, /* Never grow the heap. Returns NULL instead */
+	KMALLOC_DMA = 1 << 2,	 /* Physically contiguous and below 4 GiB */
+};
+
+struct HEAP_STATS {
+	size_t heap_size;
+	size_t free_bytes;
+	size_t largest_free_block;
+	uint64_t free_blocks;
+	uint64_t used_blocks;	 /* Includes objects cached in magazines */
+	uint64_t cached_objects; /* Freed objects held by magazines */
+};
 
 void init_heap(void *heap_address, size_t size);
 void print_heap(void);
 
+void heap_stats(struct HEAP_STATS *stats);
+
+// Walks the heap checking the block links and free list. Prints the first
+// inconsistency found and returns false.
+bool heap_validate(void);
+
+// Allocates memory without zeroing it.
 void *kmalloc(size_t size);
+
+// Allocates zeroed memory.
+void *kzalloc(size_t size);
+
+// Allocates memory with `KMALLOC_FLAGS`. Memory is zeroed unless
+// `KMALLOC_NOZERO` is given.
+void *kmalloc_flags(size_t size, uint32_t flags);
+
+// Allocates memory aligned to a power of two with `KMALLOC_FLAGS`.
+void *kmalloc_aligned(size_t size, size_t alignment, uint32_t flags);
+
+// Resizes an allocation, growing it in place when the following block is free.
+// Memory past the old size is not zeroed.
+void *krealloc(void *ptr, size_t size);
+
 void kfree(void *ptr);
 
 #endif
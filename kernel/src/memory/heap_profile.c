@@ -0,0 +1,389 @@
+#include "heap_profile.h"
+
+#if HEAP_PROFILE
+
+#include "../string/utility.h"
+#include "debug.h"
+#include "dwarf.h"
+#include "instruction.h"
+#include "macro.h"
+#include "sync/spinlock.h"
+#include "type.h"
+#include <stdbool.h>
+
+#define MIN(num1, num2) ((num1 < num2) ? num1 : num2)
+
+// Table sizes must be powers of two.
+#define HEAP_PROFILE_RING_SIZE (4096)
+#define HEAP_PROFILE_SITE_MAX (512)
+#define HEAP_PROFILE_LIVE_MAX (8192)
+
+#define HEAP_PROFILE_REPORT_SITES (16)
+#define HEAP_PROFILE_REPORT_EVENTS (16)
+#define HEAP_PROFILE_REPORT_LEAKS (32)
+
+enum HEAP_PROFILE_EVENT_TYPE {
+	HEAP_PROFILE_ALLOC,
+	HEAP_PROFILE_FREE,
+};
+
+struct HEAP_PROFILE_EVENT {
+	uint64_t tsc;
+	uintptr_t caller;
+	void *address;
+	size_t size; /* 0 for frees */
+	enum HEAP_PROFILE_EVENT_TYPE type;
+};
+
+// Totals for every allocation made from one return address.
+struct HEAP_PROFILE_SITE {
+	uintptr_t caller;
+	uint64_t allocations;
+	uint64_t frees;
+	uint64_t live_bytes;
+	uint64_t total_bytes;
+};
+
+// An allocation which has not been freed yet.
+struct HEAP_PROFILE_LIVE {
+	void *address;
+	size_t size;
+	uint64_t tsc;
+	struct HEAP_PROFILE_SITE *site;
+};
+
+typedef struct {
+	struct HEAP_PROFILE_EVENT ring[HEAP_PROFILE_RING_SIZE];
+	uint64_t event_count;
+	struct HEAP_PROFILE_SITE sites[HEAP_PROFILE_SITE_MAX];
+	struct HEAP_PROFILE_LIVE live[HEAP_PROFILE_LIVE_MAX];
+	uint64_t live_count;
+	uint64_t dropped; /* Allocations not tracked because a table was full */
+	uint64_t start_tsc;
+	bool reporting; /* Ignore allocations made while printing a report */
+	struct SPINLOCK lock;
+} Heap_Profile_Ctx;
+
+static Heap_Profile_Ctx _ctx = {0};
+
+// Mixes the bits of a pointer so neighbouring addresses spread over the table.
+static inline uint64_t hash_pointer(uintptr_t value)
+{
+	value ^= value >> 33;
+	value *= 0xff51afd7ed558ccdULL;
+	value ^= value >> 33;
+	return value;
+}
+
+static void record_event(enum HEAP_PROFILE_EVENT_TYPE type, void *address,
+						 size_t size, uintptr_t caller, uint64_t tsc)
+{
+	struct HEAP_PROFILE_EVENT *event =
+		&_ctx.ring[_ctx.event_count % HEAP_PROFILE_RING_SIZE];
+
+	event->tsc = tsc;
+	event->caller = caller;
+	event->address = address;
+	event->size = size;
+	event->type = type;
+
+	_ctx.event_count++;
+}
+
+// Finds or creates the site for a return address. Returns NULL if the table is
+// full.
+static struct HEAP_PROFILE_SITE *find_site(uintptr_t caller)
+{
+	uint64_t mask = HEAP_PROFILE_SITE_MAX - 1;
+	uint64_t index = hash_pointer(caller) & mask;
+
+	for (uint64_t i = 0; i < HEAP_PROFILE_SITE_MAX; i++) {
+		struct HEAP_PROFILE_SITE *site = &_ctx.sites[(index + i) & mask];
+
+		if (site->caller == caller) {
+			return site;
+		}
+
+		if (site->caller == 0) {
+			site->caller = caller;
+			return site;
+		}
+	}
+
+	return NULL;
+}
+
+// Finds the live table index of an address. Returns false if it is not
+// tracked.
+static bool find_live(void *address, uint64_t *index_output)
+{
+	uint64_t mask = HEAP_PROFILE_LIVE_MAX - 1;
+	uint64_t index = hash_pointer((uintptr_t)address) & mask;
+
+	while (_ctx.live[index].address != NULL) {
+		if (_ctx.live[index].address == address) {
+			*index_output = index;
+			return true;
+		}
+
+		index = (index + 1) & mask;
+	}
+
+	return false;
+}
+
+// Removes a live entry by shifting the rest of its probe run back so lookups
+// never need tombstones.
+static void remove_live(uint64_t index)
+{
+	uint64_t mask = HEAP_PROFILE_LIVE_MAX - 1;
+	uint64_t hole = index;
+
+	for (uint64_t next = (hole + 1) & mask; _ctx.live[next].address != NULL;
+		 next = (next + 1) & mask) {
+		uint64_t home = hash_pointer((uintptr_t)_ctx.live[next].address) & mask;
+
+		// Entries whose home lies cyclically in (hole, next] have to stay.
+		bool stays = (hole <= next) ? (home > hole && home <= next)
+									: (home > hole || home <= next);
+		if (!stays) {
+			_ctx.live[hole] = _ctx.live[next];
+			hole = next;
+		}
+	}
+
+	_ctx.live[hole].address = NULL;
+	_ctx.live_count--;
+}
+
+// Records an allocation. The caller must hold the profile lock.
+static void profile_alloc(void *address, size_t size, void *caller)
+{
+	uint64_t tsc = read_tsc();
+	if (_ctx.start_tsc == 0) {
+		_ctx.start_tsc = tsc;
+	}
+
+	record_event(HEAP_PROFILE_ALLOC, address, size, (uintptr_t)caller, tsc);
+
+	struct HEAP_PROFILE_SITE *site = find_site((uintptr_t)caller);
+
+	// Keep one slot empty so probing always terminates.
+	if (site == NULL || _ctx.live_count >= HEAP_PROFILE_LIVE_MAX - 1) {
+		_ctx.dropped++;
+		return;
+	}
+
+	site->allocations++;
+	site->live_bytes += size;
+	site->total_bytes += size;
+
+	uint64_t mask = HEAP_PROFILE_LIVE_MAX - 1;
+	uint64_t index = hash_pointer((uintptr_t)address) & mask;
+	while (_ctx.live[index].address != NULL) {
+		index = (index + 1) & mask;
+	}
+
+	_ctx.live[index].address = address;
+	_ctx.live[index].size = size;
+	_ctx.live[index].tsc = tsc;
+	_ctx.live[index].site = site;
+	_ctx.live_count++;
+}
+
+// Records a free. The caller must hold the profile lock.
+static void profile_free(void *address, void *caller)
+{
+	record_event(HEAP_PROFILE_FREE, address, 0, (uintptr_t)caller,
+				 read_tsc());
+
+	// Allocations made before profiling started or dropped are not tracked.
+	uint64_t index = 0;
+	if (!find_live(address, &index)) {
+		return;
+	}
+
+	struct HEAP_PROFILE_LIVE *live = &_ctx.live[index];
+	live->site->frees++;
+	live->site->live_bytes -= live->size;
+
+	remove_live(index);
+}
+
+void heap_profile_alloc(void *address, size_t size, void *caller)
+{
+	if (address == NULL ||
+		__atomic_load_n(&_ctx.reporting, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	uint64_t flags = spin_lock_irqsave(&_ctx.lock);
+	if (!_ctx.reporting) {
+		profile_alloc(address, size, caller);
+	}
+	spin_unlock_irqrestore(&_ctx.lock, flags);
+}
+
+void heap_profile_free(void *address, void *caller)
+{
+	if (address == NULL ||
+		__atomic_load_n(&_ctx.reporting, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	uint64_t flags = spin_lock_irqsave(&_ctx.lock);
+	if (!_ctx.reporting) {
+		profile_free(address, caller);
+	}
+	spin_unlock_irqrestore(&_ctx.lock, flags);
+}
+
+// Stops recording so a report can read the tables without holding the lock
+// while it prints, since symbolizing call sites may allocate.
+static void begin_report(void)
+{
+	uint64_t flags = spin_lock_irqsave(&_ctx.lock);
+	_ctx.reporting = true;
+	spin_unlock_irqrestore(&_ctx.lock, flags);
+}
+
+static void end_report(void)
+{
+	__atomic_store_n(&_ctx.reporting, false, __ATOMIC_RELEASE);
+}
+
+static void print_call_site(uintptr_t caller)
+{
+	err_code err = 0;
+	struct LINE_INFO line = {0};
+	char *symbol_string = NULL;
+
+	do {
+		// Return addresses point after the call so ask for the previous line.
+		if ((err = dwarf_query_line(caller, PREVIOUS_LINE, &line))) {
+			break;
+		}
+
+		if ((err = dwarf_query_func(caller, &symbol_string))) {
+			break;
+		}
+	} while (0);
+
+	if (symbol_string == NULL) {
+		printf("[%#018lx]\n", caller);
+	} else {
+		printf("[%#018lx] at %s (%s/%s:%ld)\n", caller, symbol_string,
+			   line.path, line.file, line.line);
+	}
+}
+
+void print_heap_profile(void)
+{
+	static struct HEAP_PROFILE_SITE *sorted[HEAP_PROFILE_SITE_MAX];
+	uint64_t site_count = 0;
+
+	begin_report();
+
+	// Sort the sites by live bytes. Insertion sort is plenty for a report.
+	for (uint64_t i = 0; i < HEAP_PROFILE_SITE_MAX; i++) {
+		struct HEAP_PROFILE_SITE *site = &_ctx.sites[i];
+		if (site->caller == 0) {
+			continue;
+		}
+
+		uint64_t j = site_count++;
+		while (j > 0 && sorted[j - 1]->live_bytes < site->live_bytes) {
+			sorted[j] = sorted[j - 1];
+			j--;
+		}
+
+		sorted[j] = site;
+	}
+
+	uint64_t elapsed = read_tsc() - _ctx.start_tsc;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	printf("=======Heap profile=======\n");
+	printf("Events: %lu Live allocations: %lu Untracked: %lu\n",
+		   _ctx.event_count, _ctx.live_count, _ctx.dropped);
+
+	for (uint64_t i = 0; i < site_count && i < HEAP_PROFILE_REPORT_SITES; i++) {
+		struct HEAP_PROFILE_SITE *site = sorted[i];
+
+		printf("Live: %'lu bytes Total: %'lu bytes Allocs: %lu Frees: %lu "
+			   "Rate: %lu allocs/Mcycle\n\t",
+			   site->live_bytes, site->total_bytes, site->allocations,
+			   site->frees, site->allocations * 1000000 / elapsed);
+		print_call_site(site->caller);
+	}
+
+	printf("Recent events:\n");
+	uint64_t event_count = MIN(_ctx.event_count, HEAP_PROFILE_REPORT_EVENTS);
+	for (uint64_t i = _ctx.event_count - event_count; i < _ctx.event_count;
+		 i++) {
+		struct HEAP_PROFILE_EVENT *event =
+			&_ctx.ring[i % HEAP_PROFILE_RING_SIZE];
+
+		printf("\t%lu %s %p %'lu bytes from %#018lx\n", event->tsc,
+			   event->type == HEAP_PROFILE_ALLOC ? "alloc" : "free ",
+			   event->address, event->size, event->caller);
+	}
+
+	end_report();
+}
+
+void print_heap_leaks(uint64_t minimum_age)
+{
+	static struct HEAP_PROFILE_LIVE *oldest[HEAP_PROFILE_REPORT_LEAKS];
+	uint64_t oldest_count = 0;
+	uint64_t leak_count = 0;
+	uint64_t leak_bytes = 0;
+	uint64_t now = read_tsc();
+
+	begin_report();
+
+	// Keep the oldest allocations sorted by age.
+	for (uint64_t i = 0; i < HEAP_PROFILE_LIVE_MAX; i++) {
+		struct HEAP_PROFILE_LIVE *live = &_ctx.live[i];
+		if (live->address == NULL || now - live->tsc < minimum_age) {
+			continue;
+		}
+
+		leak_count++;
+		leak_bytes += live->size;
+
+		uint64_t j = oldest_count;
+		if (oldest_count < HEAP_PROFILE_REPORT_LEAKS) {
+			oldest_count++;
+		} else if (oldest[j - 1]->tsc <= live->tsc) {
+			continue;
+		} else {
+			j--;
+		}
+
+		while (j > 0 && oldest[j - 1]->tsc > live->tsc) {
+			oldest[j] = oldest[j - 1];
+			j--;
+		}
+
+		oldest[j] = live;
+	}
+
+	printf("=======Heap leaks=======\n");
+	printf("Allocations older than %lu cycles: %lu (%'lu bytes)\n",
+		   minimum_age, leak_count, leak_bytes);
+
+	for (uint64_t i = 0; i < oldest_count; i++) {
+		struct HEAP_PROFILE_LIVE *live = oldest[i];
+
+		printf("%p %'lu bytes Age: %lu cycles\n\t", live->address, live->size,
+			   now - live->tsc);
+		print_call_site(live->site->caller);
+	}
+
+	end_report();
+}
+
+#endif
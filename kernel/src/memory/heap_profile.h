@@ -0,0 +1,50 @@
+#ifndef __MEMORY_HEAP_PROFILE_H
+#define __MEMORY_HEAP_PROFILE_H 1
+
+// Set to 1 to record every heap allocation and free with its call site.
+#define HEAP_PROFILE 0
+
+#ifndef HEAP_PROFILE
+#define HEAP_PROFILE 0
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if HEAP_PROFILE
+
+void heap_profile_alloc(void *address, size_t size, void *caller);
+void heap_profile_free(void *address, void *caller);
+
+// Prints live bytes and allocation rate per call site.
+void print_heap_profile(void);
+
+// Prints live allocations older than the given number of TSC cycles.
+void print_heap_leaks(uint64_t minimum_age);
+
+#else
+
+// Compiled out. The hooks vanish entirely from the allocator.
+static inline void heap_profile_alloc(void *address, size_t size, void *caller)
+{
+	(void)address;
+	(void)size;
+	(void)caller;
+}
+
+static inline void heap_profile_free(void *address, void *caller)
+{
+	(void)address;
+	(void)caller;
+}
+
+static inline void print_heap_profile(void) {}
+
+static inline void print_heap_leaks(uint64_t minimum_age)
+{
+	(void)minimum_age;
+}
+
+#endif
+
+#endif
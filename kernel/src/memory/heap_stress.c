@@ -0,0 +1,322 @@
+#include "heap_stress.h"
+#include "../string/utility.h"
+#include "cpu.h"
+#include "heap.h"
+#include "instruction.h"
+#include "macro.h"
+#include "memory.h"
+#include "panic.h"
+#include "physical.h"
+#include "type.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define STRESS_SLOTS (256)
+#define STRESS_EXCHANGE_SLOTS (1024)
+#define STRESS_FRAME_SLOTS (16)
+#define STRESS_FRAME_MAX_PAGES (8)
+
+// Every object starts with its size and fill pattern so whichever CPU ends up
+// freeing it can check it.
+struct STRESS_HEADER {
+	uint64_t size;
+	uint64_t pattern;
+};
+_Static_assert(sizeof(struct STRESS_HEADER) == 16);
+
+struct STRESS_FRAME {
+	phys_addr_t address;
+	size_t size;
+	uint8_t pattern;
+};
+
+static void *_exchange[STRESS_EXCHANGE_SLOTS] = {0};
+
+static uint64_t stress_random(uint64_t *state)
+{
+	// xorshift64*
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+// Mostly size class objects, some block heap sizes and a few page
+// allocations.
+static size_t stress_size(uint64_t *state)
+{
+	uint64_t bucket = stress_random(state) % 100;
+	uint64_t value = stress_random(state);
+
+	if (bucket < 60) {
+		return sizeof(struct STRESS_HEADER) + value % 241;
+	}
+
+	if (bucket < 90) {
+		return 257 + value % (8192 - 257);
+	}
+
+	if (bucket < 98) {
+		return 8193 + value % (64 * 1024 - 8193);
+	}
+
+	return 64 * 1024 + value % (192 * 1024);
+}
+
+static void check_bytes(const uint8_t *address, size_t size, uint8_t value,
+						const void *object)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (address[i] != value) {
+			panicf("Heap stress: %p was overwritten at offset %lu\n", object,
+				   (size_t)(address + i - (const uint8_t *)object));
+		}
+	}
+}
+
+static void *stress_alloc(uint64_t *state)
+{
+	size_t size = stress_size(state);
+	bool zeroed = stress_random(state) % 4 == 0;
+
+	uint8_t *object = zeroed ? kzalloc(size) : kmalloc(size);
+	if (object == NULL) {
+		panicf("Heap stress: allocation of %lu bytes failed\n", size);
+	}
+
+	if (zeroed) {
+		check_bytes(object, size, 0, object);
+	}
+
+	struct STRESS_HEADER *header = (struct STRESS_HEADER *)object;
+	header->size = size;
+	header->pattern = stress_random(state) % 255 + 1;
+
+	memset(object + sizeof(struct STRESS_HEADER), header->pattern,
+		   size - sizeof(struct STRESS_HEADER));
+
+	return object;
+}
+
+static void stress_free(void *object)
+{
+	struct STRESS_HEADER *header = object;
+
+	check_bytes(object + sizeof(struct STRESS_HEADER),
+				header->size - sizeof(struct STRESS_HEADER),
+				(uint8_t)header->pattern, object);
+
+	kfree(object);
+}
+
+static void frame_alloc(struct STRESS_FRAME *frame, uint64_t *state)
+{
+	err_code err = 0;
+
+	if (stress_random(state) % 2) {
+		frame->size = PAGE_BYTE_SIZE;
+		err = allocate_page(&frame->address);
+	} else {
+		frame->size = (stress_random(state) % STRESS_FRAME_MAX_PAGES + 1) *
+					  PAGE_BYTE_SIZE;
+		err = allocate_memory(frame->size, &frame->address);
+	}
+
+	if (err) {
+		panicf("Heap stress: physical allocation failed\n");
+	}
+
+	// A frame handed to two CPUs at once shows up as a pattern mismatch.
+	frame->pattern = (uint8_t)(stress_random(state) % 255 + 1);
+	memset(phys_to_virt(frame->address), frame->pattern, frame->size);
+}
+
+static void frame_free(struct STRESS_FRAME *frame)
+{
+	uint8_t *address = phys_to_virt(frame->address);
+	check_bytes(address, frame->size, frame->pattern, address);
+
+	if (release_memory(frame->address, frame->size)) {
+		panicf("Heap stress: frame %#lx was released twice\n",
+			   frame->address);
+	}
+
+	frame->size = 0;
+}
+
+void heap_stress_run(uint64_t seed, uint64_t operations,
+					 struct HEAP_STRESS_RESULT *result)
+{
+	void *slots[STRESS_SLOTS] = {0};
+	struct STRESS_FRAME frames[STRESS_FRAME_SLOTS] = {0};
+	uint64_t state = seed ? seed : 1;
+
+	memset(result, 0, sizeof(struct HEAP_STRESS_RESULT));
+
+	uint64_t start = read_tsc();
+
+	for (uint64_t i = 0; i < operations; i++) {
+		uint64_t operation = stress_random(&state) % 100;
+
+		if (operation < 80) {
+			void **slot = &slots[stress_random(&state) % STRESS_SLOTS];
+
+			if (*slot == NULL) {
+				*slot = stress_alloc(&state);
+			} else {
+				stress_free(*slot);
+				*slot = NULL;
+			}
+		} else if (operation < 95) {
+			// Swap a fresh object into the exchange and free whatever another
+			// CPU left there.
+			void *object = stress_alloc(&state);
+			void *previous = __atomic_exchange_n(
+				&_exchange[stress_random(&state) % STRESS_EXCHANGE_SLOTS],
+				object, __ATOMIC_ACQ_REL);
+
+			if (previous != NULL) {
+				stress_free(previous);
+				result->remote_frees++;
+			}
+		} else {
+			struct STRESS_FRAME *frame =
+				&frames[stress_random(&state) % STRESS_FRAME_SLOTS];
+
+			if (frame->size == 0) {
+				frame_alloc(frame, &state);
+			} else {
+				frame_free(frame);
+			}
+		}
+	}
+
+	result->cycles = read_tsc() - start;
+	result->operations = operations;
+
+	for (uint64_t i = 0; i < STRESS_SLOTS; i++) {
+		if (slots[i] != NULL) {
+			stress_free(slots[i]);
+		}
+	}
+
+	for (uint64_t i = 0; i < STRESS_FRAME_SLOTS; i++) {
+		if (frames[i].size != 0) {
+			frame_free(&frames[i]);
+		}
+	}
+}
+
+void heap_stress_drain(void)
+{
+	for (uint64_t i = 0; i < STRESS_EXCHANGE_SLOTS; i++) {
+		if (_exchange[i] != NULL) {
+			stress_free(_exchange[i]);
+			_exchange[i] = NULL;
+		}
+	}
+}
+
+#if HEAP_STRESS
+
+#define HEAP_STRESS_OPERATIONS (200000)
+
+static struct HEAP_STRESS_RESULT _results[MAX_CPUS] = {0};
+static uint32_t _barrier_count = 0;
+static uint32_t _barrier_generation = 0;
+
+// Waits until all `cpu_count` CPUs have arrived.
+static void stress_barrier(uint32_t cpu_count)
+{
+	uint32_t generation =
+		__atomic_load_n(&_barrier_generation, __ATOMIC_ACQUIRE);
+
+	if (__atomic_add_fetch(&_barrier_count, 1, __ATOMIC_ACQ_REL) ==
+		cpu_count) {
+		__atomic_store_n(&_barrier_count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&_barrier_generation, generation + 1,
+						 __ATOMIC_RELEASE);
+		return;
+	}
+
+	while (__atomic_load_n(&_barrier_generation, __ATOMIC_ACQUIRE) ==
+		   generation) {
+		cpu_relax();
+	}
+}
+
+// Prints one round. Throughput is measured against the slowest CPU since that
+// is when the round was over.
+static void stress_report(uint32_t active, uint64_t *baseline)
+{
+	uint64_t operations = 0;
+	uint64_t cycles = 1;
+	uint64_t remote_frees = 0;
+
+	for (uint32_t i = 0; i < active; i++) {
+		operations += _results[i].operations;
+		remote_frees += _results[i].remote_frees;
+		if (_results[i].cycles > cycles) {
+			cycles = _results[i].cycles;
+		}
+	}
+
+	heap_stress_drain();
+
+	if (!heap_validate()) {
+		panicf("Heap stress: heap is corrupt after %u CPUs\n", active);
+	}
+
+	uint64_t throughput = operations * 1000000 / cycles;
+	if (*baseline == 0) {
+		*baseline = throughput ? throughput : 1;
+	}
+
+	printf("\tCPUs: %2u Operations: %'lu Remote frees: %'lu Ops/Mcycle: %'lu "
+		   "Scaling: %lu.%02lux\n",
+		   active, operations, remote_frees, throughput,
+		   throughput / *baseline, throughput * 100 / *baseline % 100);
+}
+
+void heap_stress(uint32_t cpu_count)
+{
+	uint32_t cpu = cpu_index();
+	uint64_t baseline = 0;
+
+	if (cpu == 0) {
+		printf(KINFO "Stressing the allocators on %u CPUs...\n", cpu_count);
+	}
+
+	for (uint32_t active = 1;; active *= 2) {
+		if (active > cpu_count) {
+			active = cpu_count;
+		}
+
+		stress_barrier(cpu_count);
+
+		if (cpu < active) {
+			heap_stress_run(read_tsc() ^ cpu, HEAP_STRESS_OPERATIONS,
+							&_results[cpu]);
+		}
+
+		stress_barrier(cpu_count);
+
+		if (cpu == 0) {
+			stress_report(active, &baseline);
+		}
+
+		if (active == cpu_count) {
+			break;
+		}
+	}
+
+	stress_barrier(cpu_count);
+
+	if (cpu == 0) {
+		printf(KOK "Allocator stress test passed\n");
+	}
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __MEMORY_HEAP_STRESS_H
+#define __MEMORY_HEAP_STRESS_H 1
+
+// Set to 1 to stress the allocators on every CPU during boot.
+#define HEAP_STRESS 0
+
+#include <stdint.h>
+
+struct HEAP_STRESS_RESULT {
+	uint64_t operations;
+	uint64_t cycles;
+	uint64_t remote_frees; /* Objects taken from the exchange and freed */
+};
+
+// Runs one CPU's share of the stress workload. Objects are handed between CPUs
+// through a shared exchange so frees regularly happen away from the allocating
+// CPU. Every object is checked before it is freed and corruption panics.
+void heap_stress_run(uint64_t seed, uint64_t operations,
+					 struct HEAP_STRESS_RESULT *result);
+
+// Frees the objects left in the exchange. Only call it while no CPU is inside
+// `heap_stress_run`.
+void heap_stress_drain(void);
+
+#if HEAP_STRESS
+
+// Runs the workload on 1, 2, 4... CPUs up to `cpu_count` and prints the
+// throughput of each round. Every CPU has to call it.
+void heap_stress(uint32_t cpu_count);
+
+#else
+
+static inline void heap_stress(uint32_t cpu_count) { (void)cpu_count; }
+
+#endif
+
+#endif
@@ -0,0 +1,270 @@
+#include "pages.h"
+#include "../macro.h"
+#include "../string/utility.h"
+#include "debug.h"
+#include "memory.h"
+#include "physical.h"
+#include "sync/spinlock.h"
+#include "type.h"
+#include "virtual.h"
+#include <stdint.h>
+
+// Virtual window reserved for page allocations. It sits between the higher
+// half direct map and the kernel image. Host builds move it into user space.
+#ifndef PAGE_ALLOCATION_BASE
+#define PAGE_ALLOCATION_BASE (0xffffc90000000000ULL)
+#define PAGE_ALLOCATION_LIMIT (0xffffe90000000000ULL)
+#endif
+#define PAGE_ALLOCATION_MAX (256)
+
+// Every allocation is followed by an unmapped guard page so overruns fault
+// instead of corrupting the next allocation.
+#define PAGE_ALLOCATION_GUARD_PAGES (1)
+
+struct PAGE_ALLOCATION {
+	uintptr_t address;
+	size_t page_count;	   /* Mapped pages */
+	size_t reserved_count; /* Mapped pages plus guard pages */
+	bool used;
+};
+
+static struct PAGE_ALLOCATION _page_allocations[PAGE_ALLOCATION_MAX] = {0};
+static uintptr_t _next_address = PAGE_ALLOCATION_BASE;
+
+// Protects the side table and the bump pointer. Pages are mapped and unmapped
+// outside of it, which is safe because a range marked used is never touched by
+// anyone but its owner.
+static struct SPINLOCK _pages_lock = SPINLOCK_INIT;
+
+static struct PAGE_ALLOCATION *find_page_allocation(uintptr_t address)
+{
+	for (uint64_t i = 0; i < PAGE_ALLOCATION_MAX; i++) {
+		struct PAGE_ALLOCATION *allocation = &_page_allocations[i];
+		if (allocation->reserved_count && allocation->address == address) {
+			return allocation;
+		}
+	}
+
+	return NULL;
+}
+
+static struct PAGE_ALLOCATION *find_unused_slot(void)
+{
+	for (uint64_t i = 0; i < PAGE_ALLOCATION_MAX; i++) {
+		if (_page_allocations[i].reserved_count == 0) {
+			return &_page_allocations[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Reserves a virtual range of `reserved_count` pages. Freed ranges are reused
+// first fit and split when larger than needed, otherwise the range is taken
+// from the top of the window.
+static struct PAGE_ALLOCATION *reserve_range(size_t reserved_count)
+{
+	for (uint64_t i = 0; i < PAGE_ALLOCATION_MAX; i++) {
+		struct PAGE_ALLOCATION *hole = &_page_allocations[i];
+		if (hole->used || hole->reserved_count < reserved_count) {
+			continue;
+		}
+
+		if (hole->reserved_count > reserved_count) {
+			struct PAGE_ALLOCATION *remainder = find_unused_slot();
+			if (remainder == NULL) {
+				continue;
+			}
+
+			remainder->address =
+				hole->address + reserved_count * PAGE_BYTE_SIZE;
+			remainder->reserved_count = hole->reserved_count - reserved_count;
+			remainder->used = false;
+			hole->reserved_count = reserved_count;
+		}
+
+		hole->used = true;
+		return hole;
+	}
+
+	if (reserved_count >
+		(PAGE_ALLOCATION_LIMIT - _next_address) / PAGE_BYTE_SIZE) {
+		return NULL;
+	}
+
+	struct PAGE_ALLOCATION *allocation = find_unused_slot();
+	if (allocation == NULL) {
+		return NULL;
+	}
+
+	allocation->address = _next_address;
+	allocation->reserved_count = reserved_count;
+	allocation->used = true;
+	_next_address += reserved_count * PAGE_BYTE_SIZE;
+
+	return allocation;
+}
+
+// Gives a virtual range back. Neighbouring holes are merged so the side table
+// does not fill up with fragments, and holes reaching the top of the window are
+// returned to the bump pointer.
+static void release_range(struct PAGE_ALLOCATION *allocation)
+{
+	allocation->used = false;
+	allocation->page_count = 0;
+
+	for (uint64_t i = 0; i < PAGE_ALLOCATION_MAX; i++) {
+		struct PAGE_ALLOCATION *hole = &_page_allocations[i];
+		if (hole == allocation || hole->used || hole->reserved_count == 0) {
+			continue;
+		}
+
+		uintptr_t hole_end =
+			hole->address + hole->reserved_count * PAGE_BYTE_SIZE;
+		uintptr_t allocation_end =
+			allocation->address + allocation->reserved_count * PAGE_BYTE_SIZE;
+
+		if (hole_end == allocation->address) {
+			allocation->address = hole->address;
+			allocation->reserved_count += hole->reserved_count;
+			hole->reserved_count = 0;
+		} else if (allocation_end == hole->address) {
+			allocation->reserved_count += hole->reserved_count;
+			hole->reserved_count = 0;
+		}
+	}
+
+	if (allocation->address + allocation->reserved_count * PAGE_BYTE_SIZE ==
+		_next_address) {
+		_next_address = allocation->address;
+		allocation->reserved_count = 0;
+	}
+}
+
+// Unmaps the first `mapped_count` pages of an allocation and releases their
+// frames.
+static void unmap_pages(uintptr_t address, size_t mapped_count)
+{
+	for (size_t i = 0; i < mapped_count; i++) {
+		virt_addr_t page = (virt_addr_t)(address + i * PAGE_BYTE_SIZE);
+		phys_addr_t physical_address = 0;
+
+		if (!translate_address(page, &physical_address)) {
+			continue;
+		}
+
+		unmap_memory(page, PAGE_BYTE_SIZE);
+		release_memory(physical_address, PAGE_BYTE_SIZE);
+	}
+}
+
+void *alloc_pages(size_t page_count)
+{
+	if (page_count == 0) {
+		return NULL;
+	}
+
+	uint64_t flags = spin_lock_irqsave(&_pages_lock);
+	struct PAGE_ALLOCATION *allocation =
+		reserve_range(page_count + PAGE_ALLOCATION_GUARD_PAGES);
+	spin_unlock_irqrestore(&_pages_lock, flags);
+
+	if (allocation == NULL) {
+		printf(KWARN "Page allocation window is exhausted\n");
+		return NULL;
+	}
+
+	for (size_t i = 0; i < page_count; i++) {
+		virt_addr_t page =
+			(virt_addr_t)(allocation->address + i * PAGE_BYTE_SIZE);
+		phys_addr_t physical_address = 0;
+		err_code err = 0;
+
+		if ((err = allocate_page(&physical_address))) {
+			debug_code(err);
+			unmap_pages(allocation->address, i);
+
+			flags = spin_lock_irqsave(&_pages_lock);
+			release_range(allocation);
+			spin_unlock_irqrestore(&_pages_lock, flags);
+			return NULL;
+		}
+
+		if (!map_memory(physical_address, page, PAGE_BYTE_SIZE,
+						PAGE_MAP_WRITEABLE)) {
+			release_memory(physical_address, PAGE_BYTE_SIZE);
+			unmap_pages(allocation->address, i);
+
+			flags = spin_lock_irqsave(&_pages_lock);
+			release_range(allocation);
+			spin_unlock_irqrestore(&_pages_lock, flags);
+			return NULL;
+		}
+	}
+
+	flags = spin_lock_irqsave(&_pages_lock);
+	allocation->page_count = page_count;
+	spin_unlock_irqrestore(&_pages_lock, flags);
+
+	return (void *)allocation->address;
+}
+
+void free_pages(void *address)
+{
+	uint64_t flags = spin_lock_irqsave(&_pages_lock);
+	struct PAGE_ALLOCATION *allocation =
+		find_page_allocation((uintptr_t)address);
+	spin_unlock_irqrestore(&_pages_lock, flags);
+
+	if (allocation == NULL || !allocation->used) {
+		printf(KWARN "Freeing unknown page allocation: %p\n", address);
+		return;
+	}
+
+	// The range stays marked used until its pages are gone so it can not be
+	// handed out again while they are still mapped.
+	unmap_pages(allocation->address, allocation->page_count);
+
+	flags = spin_lock_irqsave(&_pages_lock);
+	release_range(allocation);
+	spin_unlock_irqrestore(&_pages_lock, flags);
+}
+
+bool is_page_allocation(const void *address)
+{
+	return (uintptr_t)address >= PAGE_ALLOCATION_BASE &&
+		   (uintptr_t)address < PAGE_ALLOCATION_LIMIT;
+}
+
+size_t page_allocation_size(const void *address)
+{
+	size_t size = 0;
+
+	uint64_t flags = spin_lock_irqsave(&_pages_lock);
+	struct PAGE_ALLOCATION *allocation =
+		find_page_allocation((uintptr_t)address);
+	if (allocation != NULL && allocation->used) {
+		size = allocation->page_count * PAGE_BYTE_SIZE;
+	}
+	spin_unlock_irqrestore(&_pages_lock, flags);
+
+	return size;
+}
+
+void print_page_allocations(void)
+{
+	uint64_t flags = spin_lock_irqsave(&_pages_lock);
+
+	for (uint64_t i = 0; i < PAGE_ALLOCATION_MAX; i++) {
+		struct PAGE_ALLOCATION *allocation = &_page_allocations[i];
+		if (!allocation->used) {
+			continue;
+		}
+
+		printf("\t%p Pages: %lu Size: %'lu bytes\n",
+			   (void *)allocation->address, allocation->page_count,
+			   (size_t)(allocation->page_count * PAGE_BYTE_SIZE));
+	}
+
+	spin_unlock_irqrestore(&_pages_lock, flags);
+}
@@ -0,0 +1,24 @@
+#ifndef __MEMORY_PAGES_H
+#define __MEMORY_PAGES_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Allocates virtually contiguous pages backed by individual page frames.
+// Returns NULL if no virtual range or physical memory is available.
+void *alloc_pages(size_t page_count);
+
+// Unmaps the pages of an allocation and returns the frames to the physical
+// allocator.
+void free_pages(void *address);
+
+// Returns true if the address is inside the page allocation window.
+bool is_page_allocation(const void *address);
+
+// Returns the size in bytes of the page allocation starting at the address or
+// 0 if there is none.
+size_t page_allocation_size(const void *address);
+
+void print_page_allocations(void);
+
+#endif
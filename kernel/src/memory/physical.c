@@ -4,18 +4,26 @@
 #include "debug.h"
 #include "memory.h"
 #include "panic.h"
+#include "sync/spinlock.h"
 #include "type.h"
 #include <stdbool.h>
 #include <stddef.h>
 
+#define MAX(num1, num2) ((num1 > num2) ? num1 : num2)
+
 #define PAGES_PER_BYTE (8ULL)
 #define PAGES_PER_BITMAP_INDEX (64ULL)
 
+// Bitmap words are only changed with atomic operations so single pages can be
+// allocated and released without a lock. Contiguous allocations still take the
+// lock to keep them from fighting each other over the same run.
 typedef struct {
 	size_t bitmap_size;
 	uint64_t *bitmap;
 	uint64_t used_pages;
 	uint64_t total_pages;
+	uint64_t search_hint; /* Free pages are rare below this bitmap index */
+	struct SPINLOCK lock; /* Serializes contiguous allocations */
 } Phys_Ctx;
 
 static Phys_Ctx _ctx = {0};
@@ -60,7 +68,8 @@ static inline size_t size_to_num_of_pages(size_t size_in_bytes)
 // Determines if the page is used.
 static inline bool is_page_used(Phys_Ctx *memory, uint64_t page_index)
 {
-	return memory->bitmap[page_index / PAGES_PER_BITMAP_INDEX] &
+	return __atomic_load_n(&memory->bitmap[page_index / PAGES_PER_BITMAP_INDEX],
+						   __ATOMIC_RELAXED) &
 		   (1ULL << (page_index % PAGES_PER_BITMAP_INDEX));
 }
 
@@ -91,26 +100,70 @@ static inline err_code addr_to_page_index(Phys_Ctx *memory,
 	return 0;
 }
 
-// Sets a single page frame as used.
-static inline void reserve_page(Phys_Ctx *memory, uintptr_t page_index)
+// Sets a single page frame as used. Returns false if it already was, in which
+// case nothing is changed.
+static inline bool reserve_page(Phys_Ctx *memory, uintptr_t page_index)
 {
-	memory->bitmap[page_index / PAGES_PER_BITMAP_INDEX] |=
-		(1ULL << (page_index % PAGES_PER_BITMAP_INDEX));
-	memory->used_pages++;
+	uint64_t bit = 1ULL << (page_index % PAGES_PER_BITMAP_INDEX);
+	uint64_t previous =
+		__atomic_fetch_or(&memory->bitmap[page_index / PAGES_PER_BITMAP_INDEX],
+						  bit, __ATOMIC_ACQUIRE);
+	if (previous & bit) {
+		return false;
+	}
+
+	__atomic_fetch_add(&memory->used_pages, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+// Lowers the search hint to a bitmap index if it is above it.
+static inline void lower_search_hint(Phys_Ctx *memory, uint64_t index)
+{
+	uint64_t hint = __atomic_load_n(&memory->search_hint, __ATOMIC_RELAXED);
+
+	while (index < hint &&
+		   !__atomic_compare_exchange_n(&memory->search_hint, &hint, index,
+										true, __ATOMIC_RELAXED,
+										__ATOMIC_RELAXED)) {
+	}
 }
 
 // Sets a single page frame as available
 static inline void release_page(Phys_Ctx *memory, uintptr_t page_index)
 {
-	memory->bitmap[page_index / PAGES_PER_BITMAP_INDEX] &=
-		~(1ULL << (page_index % PAGES_PER_BITMAP_INDEX));
-	memory->used_pages--;
+	__atomic_fetch_and(&memory->bitmap[page_index / PAGES_PER_BITMAP_INDEX],
+					   ~(1ULL << (page_index % PAGES_PER_BITMAP_INDEX)),
+					   __ATOMIC_RELEASE);
+	__atomic_fetch_sub(&memory->used_pages, 1, __ATOMIC_RELAXED);
+
+	lower_search_hint(memory, page_index / PAGES_PER_BITMAP_INDEX);
+}
+
+// Marks a run of pages as used. If another CPU took one of them first the
+// pages reserved so far are released again and the contested page index is
+// given through `conflict_output`.
+static bool reserve_pages(Phys_Ctx *memory, uint64_t page_index,
+						  uint64_t page_count, uint64_t *conflict_output)
+{
+	for (uint64_t i = page_index; i < page_index + page_count; i++) {
+		if (!reserve_page(memory, i)) {
+			for (uint64_t j = page_index; j < i; j++) {
+				release_page(memory, j);
+			}
+
+			*conflict_output = i;
+			return false;
+		}
+	}
+
+	return true;
 }
 
 // Opens up a region of page frames to be able to be allocated for general
 // purpose use. Returns the error code `ERROR_ADDRESS_ALIGNMENT` if the physical
 // page address is not page aligned or `ERROR_OUT_OF_BOUNDS` if the physical
-// address is outside the bounds of the memory bitmap.
+// address is outside the bounds of the memory bitmap. If any page is already
+// free the error code `ERROR_ALREADY_FREE` is returned and nothing is released.
 err_code release_memory(const phys_addr_t physical_address,
 						const size_t size_in_bytes)
 {
@@ -125,11 +178,18 @@ err_code release_memory(const phys_addr_t physical_address,
 	size_t page_count = size_to_num_of_pages(size_in_bytes);
 
 	uint64_t page_index_end = page_index + page_count;
-	if (page_index_end >= _ctx.total_pages) {
+	if (page_index_end > _ctx.total_pages) {
 		debug_code(ERROR_OUT_OF_BOUNDS);
 		return ERROR_OUT_OF_BOUNDS;
 	}
 
+	for (uint64_t i = page_index; i < page_index_end; i++) {
+		if (is_page_used(&_ctx, i) == false) {
+			debug_code(ERROR_ALREADY_FREE);
+			return ERROR_ALREADY_FREE;
+		}
+	}
+
 	for (uint64_t i = page_index; i < page_index_end; i++) {
 		release_page(&_ctx, i);
 	}
@@ -139,8 +199,8 @@ err_code release_memory(const phys_addr_t physical_address,
 
 // Reserves a region of pages to not be used. If the physical address is invalid
 // the error codes `ERROR_ADDRESS_ALIGNMENT` or `ERROR_OUT_OF_BOUNDS` may be
-// returned. If the address is already reserved the error code
-// `ERROR_ALREADY_USED` will be returned.
+// returned. If any page is already reserved the error code `ERROR_ALREADY_USED`
+// will be returned and nothing is reserved.
 err_code reserve_memory(phys_addr_t physical_address, size_t size_in_bytes)
 {
 	err_code err = 0;
@@ -153,18 +213,15 @@ err_code reserve_memory(phys_addr_t physical_address, size_t size_in_bytes)
 	}
 
 	uint64_t page_index_end = page_index + page_count;
-	if (page_index_end >= _ctx.total_pages) {
+	if (page_index_end > _ctx.total_pages) {
 		debug_code(ERROR_OUT_OF_BOUNDS);
 		return ERROR_OUT_OF_BOUNDS;
 	}
 
-	for (uint64_t i = page_index; i < page_index_end; i++) {
-		if (is_page_used(&_ctx, i) == true) {
-			debug_code(ERROR_ALREADY_USED);
-			return ERROR_ALREADY_USED;
-		}
-
-		reserve_page(&_ctx, i);
+	uint64_t conflict = 0;
+	if (!reserve_pages(&_ctx, page_index, page_count, &conflict)) {
+		debug_code(ERROR_ALREADY_USED);
+		return ERROR_ALREADY_USED;
 	}
 
 	return 0;
@@ -213,22 +270,131 @@ err_code allocate_memory(const size_t size_in_bytes,
 
 	size_t pages_needed = size_to_num_of_pages(size_in_bytes);
 	uint64_t page_index = 0;
+	uint64_t start_page_index = MAX(
+		1, __atomic_load_n(&_ctx.search_hint, __ATOMIC_RELAXED) *
+			   PAGES_PER_BITMAP_INDEX);
+
+	bool searched_all = start_page_index == 1;
+
+	uint64_t flags = spin_lock_irqsave(&_ctx.lock);
+
+	while (true) {
+		if ((err = find_pages(pages_needed, start_page_index, _ctx.total_pages,
+							  &page_index))) {
+			// The hint is only a hint, so look at the whole bitmap once before
+			// giving up.
+			if (!searched_all) {
+				searched_all = true;
+				start_page_index = 1;
+				continue;
+			}
+
+			spin_unlock_irqrestore(&_ctx.lock, flags);
+			debug_code(err);
+			return err;
+		}
 
-	if ((err = find_pages(pages_needed, 1, _ctx.total_pages, &page_index))) {
-		debug_code(err);
-		return err;
+		// A single page allocation on another CPU may have taken one of the
+		// pages since they were found. Search again past it.
+		uint64_t conflict = 0;
+		if (reserve_pages(&_ctx, page_index, pages_needed, &conflict)) {
+			break;
+		}
+
+		start_page_index = conflict + 1;
 	}
 
-	phys_addr_t address = page_index * PAGE_BYTE_SIZE;
-	if ((err = reserve_memory(address, size_in_bytes))) {
-		debug_code(err);
-		return err;
+	spin_unlock_irqrestore(&_ctx.lock, flags);
+
+	*output_physical_address = page_index * PAGE_BYTE_SIZE;
+	return 0;
+}
+
+// Takes the lowest free page in the bitmap words `[start, end)`. Returns false
+// if there is none.
+static bool take_free_page(uint64_t start, uint64_t end,
+						   uint64_t *output_page_index)
+{
+	for (uint64_t i = start; i < end; i++) {
+		uint64_t word = __atomic_load_n(&_ctx.bitmap[i], __ATOMIC_RELAXED);
+
+		while (true) {
+			uint64_t free_pages = ~word;
+
+			// Never hand out the zero page.
+			if (i == 0) {
+				free_pages &= ~1ULL;
+			}
+
+			if (free_pages == 0) {
+				break;
+			}
+
+			uint64_t bit = free_pages & -free_pages;
+			word = __atomic_fetch_or(&_ctx.bitmap[i], bit, __ATOMIC_ACQUIRE);
+
+			// Another CPU may have taken the page first. `word` now holds the
+			// current bits so try the next free one.
+			if (!(word & bit)) {
+				__atomic_fetch_add(&_ctx.used_pages, 1, __ATOMIC_RELAXED);
+				*output_page_index =
+					i * PAGES_PER_BITMAP_INDEX + __builtin_ctzll(bit);
+				return true;
+			}
+		}
 	}
 
-	*output_physical_address = address;
+	return false;
+}
+
+// Allocates a single page frame. Whole bitmap words are skipped at a time so
+// this is much cheaper than `allocate_memory` for callers which do not need
+// contiguous memory. It takes no lock, so it is safe to call from any CPU and
+// from interrupt handlers. Returns the error code `ERROR_NOT_FOUND` if physical
+// memory is exhausted.
+err_code allocate_page(phys_addr_t *output_physical_address)
+{
+	uint64_t bitmap_length = _ctx.total_pages / PAGES_PER_BITMAP_INDEX;
+	uint64_t hint = __atomic_load_n(&_ctx.search_hint, __ATOMIC_RELAXED);
+	uint64_t page_index = 0;
+
+	if (take_free_page(hint, bitmap_length, &page_index)) {
+		// Only move the hint up if nobody released a page below it meanwhile.
+		uint64_t index = page_index / PAGES_PER_BITMAP_INDEX;
+		if (index > hint) {
+			__atomic_compare_exchange_n(&_ctx.search_hint, &hint, index, false,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	} else if (!take_free_page(0, hint, &page_index)) {
+		// Racing releases can leave free pages below the hint, so those are
+		// searched before giving up.
+		debug_code(ERROR_NOT_FOUND);
+		return ERROR_NOT_FOUND;
+	}
+
+	*output_physical_address = page_index * PAGE_BYTE_SIZE;
 	return 0;
 }
 
+void physical_stats(struct PHYSICAL_STATS *stats)
+{
+	uint64_t free_run = 0;
+
+	stats->total_pages = _ctx.total_pages;
+	stats->used_pages = __atomic_load_n(&_ctx.used_pages, __ATOMIC_RELAXED);
+	stats->largest_free_run = 0;
+
+	for (uint64_t i = 0; i < _ctx.total_pages; i++) {
+		if (is_page_used(&_ctx, i)) {
+			free_run = 0;
+			continue;
+		}
+
+		free_run++;
+		stats->largest_free_run = MAX(stats->largest_free_run, free_run);
+	}
+}
+
 struct MEMORY_BITMAP init_physical_memory(void)
 {
 	printf(KINFO "Initiating physical memory management...\n");
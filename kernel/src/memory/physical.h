@@ -6,8 +6,16 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+struct PHYSICAL_STATS {
+	uint64_t total_pages;
+	uint64_t used_pages;
+	uint64_t largest_free_run; /* Longest run of contiguous free pages */
+};
+
 struct MEMORY_BITMAP init_physical_memory(void);
 
+void physical_stats(struct PHYSICAL_STATS *stats);
+
 err_code reserve_memory(const phys_addr_t physical_address,
 						const size_t size_in_bytes);
 
@@ -17,4 +25,6 @@ err_code release_memory(const phys_addr_t physical_address,
 err_code allocate_memory(const size_t size_in_bytes,
 						 phys_addr_t *output_physical_address);
 
+err_code allocate_page(phys_addr_t *output_physical_address);
+
 #endif
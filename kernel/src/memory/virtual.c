@@ -10,6 +10,7 @@
 #include "memory.h"
 #include "panic.h"
 #include "physical.h"
+#include "sync/spinlock.h"
 #include "virtual.h"
 
 #define PT_POOL_SIZE (10)
@@ -51,6 +52,13 @@ struct VIRTUAL_MEMORY_CONTEXT {
 
 static struct VIRTUAL_MEMORY_CONTEXT _vm_context = {0};
 
+// Protects the kernel page tables and the page table pool. Taken with
+// interrupts disabled since the heap maps memory from interrupt context.
+static struct SPINLOCK _vm_lock = SPINLOCK_INIT;
+
+static bool map_range(phys_addr_t physical_addr, virt_addr_t virtual_addr,
+					  size_t size_in_bytes, uint32_t flags);
+
 // Gets the table pointed by a page entry.
 static struct PAGE_TABLE *get_table_from_entry(union PAGE_ENTRY *entry)
 {
@@ -97,8 +105,8 @@ static void maybe_restock_page_table_pool(void)
 			// virtual address.
 			_vm_context.pt_pool[i] = virtual_address;
 
-			map_memory(physical_address, virtual_address, PAGE_BYTE_SIZE,
-					   PAGE_MAP_WRITEABLE);
+			map_range(physical_address, virtual_address, PAGE_BYTE_SIZE,
+					  PAGE_MAP_WRITEABLE);
 
 			memset(virtual_address, 0, PAGE_BYTE_SIZE);
 		}
@@ -191,19 +199,128 @@ static bool map_page(phys_addr_t physical_address, virt_addr_t virtual_address,
 	return true;
 }
 
+// Maps a range of pages. The caller must hold `_vm_lock`.
+static bool map_range(phys_addr_t physical_addr, virt_addr_t virtual_addr,
+					  size_t size_in_bytes, uint32_t flags)
+{
+	for (uintptr_t offset = 0; offset < size_in_bytes;
+		 offset += PAGE_BYTE_SIZE) {
+		if (!map_page(physical_addr + offset, virtual_addr + offset, flags)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 // Maps a virtual address to a given physical address for the required amount of
 // pages needed by the given size in bytes.
 bool map_memory(phys_addr_t physical_addr, virt_addr_t virtual_addr,
 				size_t size_in_bytes, uint32_t flags)
 {
+	uint64_t irq_flags = spin_lock_irqsave(&_vm_lock);
+	bool mapped = map_range(physical_addr, virtual_addr, size_in_bytes, flags);
+	spin_unlock_irqrestore(&_vm_lock, irq_flags);
+
+	return mapped;
+}
+
+// Finds the page table entry mapping a virtual address without creating any
+// tables. Returns NULL if the address is not mapped.
+static union PAGE_ENTRY *find_page_entry(virt_addr_t virtual_address)
+{
+	struct PAGE_TABLE *pml4_table = _vm_context.pml4_table;
+	if (pml4_table == NULL) {
+		printf(KERROR "PML4 table is null\n");
+		return NULL;
+	}
+
+	union PAGE_ENTRY *pml4_entry =
+		&pml4_table->entries[PML4E_INDEX(virtual_address)];
+	if (!pml4_entry->present) {
+		return NULL;
+	}
+
+	struct PAGE_TABLE *pdp_table = get_table_from_entry(pml4_entry);
+	union PAGE_ENTRY *pdp_entry =
+		&pdp_table->entries[PDPE_INDEX(virtual_address)];
+	if (!pdp_entry->present) {
+		return NULL;
+	}
+
+	struct PAGE_TABLE *pd_table = get_table_from_entry(pdp_entry);
+	union PAGE_ENTRY *pd_entry = &pd_table->entries[PDE_INDEX(virtual_address)];
+	if (!pd_entry->present) {
+		return NULL;
+	}
+
+	struct PAGE_TABLE *pt_table = get_table_from_entry(pd_entry);
+	union PAGE_ENTRY *pt_entry = &pt_table->entries[PTE_INDEX(virtual_address)];
+	if (!pt_entry->present) {
+		return NULL;
+	}
+
+	return pt_entry;
+}
+
+// Unmaps a single page. Page tables left empty are kept for reuse. Returns
+// false if the page was not mapped.
+static bool unmap_page(virt_addr_t virtual_address)
+{
+	union PAGE_ENTRY *pt_entry = find_page_entry(virtual_address);
+	if (pt_entry == NULL) {
+		return false;
+	}
+
+	pt_entry->raw = 0;
+
+	// Always invalidate. A stale translation for a page that gets reused is far
+	// worse than a redundant invlpg.
+	flush_tlb(virtual_address);
+
+	return true;
+}
+
+// Gets the physical address a virtual address is mapped to. Returns false if
+// the address is not mapped.
+bool translate_address(virt_addr_t virtual_address,
+					   phys_addr_t *output_physical_address)
+{
+	uint64_t flags = spin_lock_irqsave(&_vm_lock);
+
+	union PAGE_ENTRY *pt_entry = find_page_entry(virtual_address);
+	if (pt_entry == NULL) {
+		spin_unlock_irqrestore(&_vm_lock, flags);
+		return false;
+	}
+
+	uint64_t phys_mask = (1ULL << (_vm_context.physical_address_size - 12)) - 1;
+	*output_physical_address =
+		((pt_entry->raw >> 12) & phys_mask) * PAGE_BYTE_SIZE +
+		((uintptr_t)virtual_address % PAGE_BYTE_SIZE);
+
+	spin_unlock_irqrestore(&_vm_lock, flags);
+	return true;
+}
+
+// Removes the mappings for the pages covered by the given size in bytes. The
+// physical memory is not released. Returns false if any page was not mapped.
+bool unmap_memory(virt_addr_t virtual_addr, size_t size_in_bytes)
+{
+	bool all_mapped = true;
+
+	uint64_t flags = spin_lock_irqsave(&_vm_lock);
+
 	for (uintptr_t offset = 0; offset < size_in_bytes;
 		 offset += PAGE_BYTE_SIZE) {
-		if (!map_page(physical_addr + offset, virtual_addr + offset, flags)) {
-			return false;
+		if (!unmap_page(virtual_addr + offset)) {
+			all_mapped = false;
 		}
 	}
 
-	return true;
+	spin_unlock_irqrestore(&_vm_lock, flags);
+
+	return all_mapped;
 }
 
 void print_memory_mapping(void)
@@ -17,7 +17,8 @@ void print_memory_mapping(void);
 
 bool map_memory(phys_addr_t physical_address, virt_addr_t virtual_address,
 				size_t size_in_bytes, uint32_t flags);
-// bool unmap_memory(virt_addr_t virtual_address, size_t size_in_bytes); // TODO
-// implement when needed
+bool unmap_memory(virt_addr_t virtual_address, size_t size_in_bytes);
+bool translate_address(virt_addr_t virtual_address,
+					   phys_addr_t *output_physical_address);
 
 #endif
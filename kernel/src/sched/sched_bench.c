@@ -0,0 +1,278 @@
+#include "sched_bench.h"
+
+#if SCHED_BENCH
+
+#include "cpu.h"
+#include "instruction.h"
+#include "macro.h"
+#include "panic.h"
+#include "scheduler.h"
+#include "string/utility.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BENCH_YIELDS (100000)
+#define BENCH_ROUND_TRIPS (20000)
+#define BENCH_STEAL_THREADS_PER_CPU (4)
+#define BENCH_STEAL_CHUNKS (8)
+#define BENCH_STEAL_CHUNK_CYCLES (1000000)
+#define BENCH_MAX_CPUS (8)
+#define BENCH_MAX_WORKERS (MAX_CPUS * BENCH_STEAL_THREADS_PER_CPU)
+
+struct BENCH_WORKER {
+	struct THREAD *thread;
+	struct BENCH_WORKER *peer;
+	uint64_t iterations;
+	uint64_t cycles;
+	uint32_t finished_on;
+	bool leader;
+};
+
+static struct BENCH_WORKER _workers[BENCH_MAX_WORKERS] = {0};
+static struct THREAD *_waiter = NULL;
+static uint32_t _remaining = 0;
+static bool _go = false;
+
+static void wait_for_go(void)
+{
+	while (!__atomic_load_n(&_go, __ATOMIC_ACQUIRE)) {
+		thread_yield();
+	}
+}
+
+static void worker_done(struct BENCH_WORKER *worker)
+{
+	worker->finished_on = cpu_index();
+
+	if (__atomic_sub_fetch(&_remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+		thread_wake(_waiter);
+	}
+}
+
+static void yield_worker(void *argument)
+{
+	struct BENCH_WORKER *worker = argument;
+
+	wait_for_go();
+
+	uint64_t start = read_tsc();
+
+	for (uint64_t i = 0; i < worker->iterations; i++) {
+		thread_yield();
+	}
+
+	worker->cycles = read_tsc() - start;
+	worker_done(worker);
+}
+
+// The leader wakes its peer and blocks, the peer blocks and wakes the leader,
+// so every iteration is two wake ups.
+static void ping_pong_worker(void *argument)
+{
+	struct BENCH_WORKER *worker = argument;
+
+	wait_for_go();
+
+	uint64_t start = read_tsc();
+
+	for (uint64_t i = 0; i < worker->iterations; i++) {
+		if (worker->leader) {
+			thread_wake(worker->peer->thread);
+			thread_block();
+		} else {
+			thread_block();
+			thread_wake(worker->peer->thread);
+		}
+	}
+
+	worker->cycles = read_tsc() - start;
+	worker_done(worker);
+}
+
+static void spin_worker(void *argument)
+{
+	struct BENCH_WORKER *worker = argument;
+
+	wait_for_go();
+
+	uint64_t start = read_tsc();
+
+	for (uint32_t i = 0; i < BENCH_STEAL_CHUNKS; i++) {
+		uint64_t chunk = read_tsc();
+		while (read_tsc() - chunk < BENCH_STEAL_CHUNK_CYCLES) {
+			cpu_relax();
+		}
+
+		thread_yield();
+	}
+
+	worker->cycles = read_tsc() - start;
+	worker_done(worker);
+}
+
+static void spawn(uint32_t index, thread_entry entry, int32_t cpu)
+{
+	_workers[index].thread = thread_create("bench", entry, &_workers[index],
+										   THREAD_PRIORITY_NORMAL, cpu);
+	if (_workers[index].thread == NULL) {
+		panicf("Scheduler bench: could not create thread %u\n", index);
+	}
+}
+
+// Releases the workers and blocks until the last one is done.
+static void run_workers(void)
+{
+	__atomic_store_n(&_go, true, __ATOMIC_RELEASE);
+	thread_block();
+	__atomic_store_n(&_go, false, __ATOMIC_RELAXED);
+}
+
+static void prepare(uint32_t count, uint64_t iterations)
+{
+	memset(_workers, 0, sizeof(struct BENCH_WORKER) * count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		_workers[i].iterations = iterations;
+	}
+
+	_waiter = thread_current();
+	_remaining = count;
+}
+
+static uint64_t slowest(uint32_t count)
+{
+	uint64_t cycles = 1;
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (_workers[i].cycles > cycles) {
+			cycles = _workers[i].cycles;
+		}
+	}
+
+	return cycles;
+}
+
+// Two threads yielding to each other on one CPU.
+static void bench_yield_latency(void)
+{
+	prepare(2, BENCH_YIELDS);
+	spawn(0, yield_worker, 0);
+	spawn(1, yield_worker, 0);
+	run_workers();
+
+	printf("\tYield on one CPU: %'lu cycles per switch\n",
+		   slowest(2) / (BENCH_YIELDS * 2));
+}
+
+// Block and wake up between two CPUs, or on one CPU if there is no other.
+static void bench_wake_latency(void)
+{
+	uint32_t other = cpu_count() > 1 ? 1 : 0;
+
+	prepare(2, BENCH_ROUND_TRIPS);
+	_workers[0].leader = true;
+	_workers[0].peer = &_workers[1];
+	_workers[1].peer = &_workers[0];
+
+	spawn(0, ping_pong_worker, 0);
+	spawn(1, ping_pong_worker, other);
+	run_workers();
+
+	printf("\tWake up %s: %'lu cycles per wake up\n",
+		   other ? "across CPUs" : "on one CPU",
+		   slowest(2) / (BENCH_ROUND_TRIPS * 2));
+}
+
+// Two yielding threads on each of the first `active` CPUs.
+static void bench_throughput(uint32_t active, uint64_t *baseline)
+{
+	uint32_t count = active * 2;
+
+	prepare(count, BENCH_YIELDS);
+
+	for (uint32_t i = 0; i < count; i++) {
+		spawn(i, yield_worker, i / 2);
+	}
+
+	run_workers();
+
+	uint64_t throughput = count * BENCH_YIELDS * 1000000 / slowest(count);
+	if (*baseline == 0) {
+		*baseline = throughput ? throughput : 1;
+	}
+
+	printf("\tCPUs: %u Switches/Mcycle: %'lu Scaling: %lu.%02lux\n", active,
+		   throughput, throughput / *baseline,
+		   throughput * 100 / *baseline % 100);
+}
+
+// Queues all threads on this CPU and lets the idle ones steal them.
+static void bench_stealing(void)
+{
+	uint32_t count = cpu_count() * BENCH_STEAL_THREADS_PER_CPU;
+	uint32_t finished[MAX_CPUS] = {0};
+	uint64_t steals[MAX_CPUS] = {0};
+
+	for (uint32_t i = 0; i < cpu_count(); i++) {
+		struct SCHEDULER_STATS stats;
+		scheduler_stats(i, &stats);
+		steals[i] = stats.steals;
+	}
+
+	prepare(count, 0);
+
+	for (uint32_t i = 0; i < count; i++) {
+		spawn(i, spin_worker, THREAD_ANY_CPU);
+	}
+
+	uint64_t start = read_tsc();
+	run_workers();
+	uint64_t elapsed = read_tsc() - start;
+
+	for (uint32_t i = 0; i < count; i++) {
+		finished[_workers[i].finished_on]++;
+	}
+
+	// Perfectly spread work would take this many chunks per CPU.
+	uint64_t ideal = (uint64_t)count * BENCH_STEAL_CHUNKS *
+					 BENCH_STEAL_CHUNK_CYCLES / cpu_count();
+
+	printf("\tWork stealing: %u threads in %'lu cycles, %lu.%02lux of ideal\n",
+		   count, elapsed, elapsed / ideal, elapsed * 100 / ideal % 100);
+
+	for (uint32_t i = 0; i < cpu_count(); i++) {
+		struct SCHEDULER_STATS stats;
+		scheduler_stats(i, &stats);
+
+		printf("\t\tCPU %u: finished %u stole %lu\n", i, finished[i],
+			   stats.steals - steals[i]);
+	}
+}
+
+void sched_bench(void)
+{
+	uint64_t baseline = 0;
+
+	printf(KINFO "Benchmarking the scheduler on %u CPUs...\n", cpu_count());
+
+	bench_yield_latency();
+	bench_wake_latency();
+
+	for (uint32_t active = 1;; active *= 2) {
+		if (active > cpu_count()) {
+			active = cpu_count();
+		}
+
+		bench_throughput(active, &baseline);
+
+		if (active == cpu_count() || active >= BENCH_MAX_CPUS) {
+			break;
+		}
+	}
+
+	bench_stealing();
+
+	printf(KOK "Scheduler benchmark done\n");
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef __SCHED_SCHED_BENCH_H
+#define __SCHED_SCHED_BENCH_H 1
+
+// Set to 1 to measure context switch latency and throughput during boot.
+#define SCHED_BENCH 0
+
+#if SCHED_BENCH
+
+// Measures yield and wake up latency, switch throughput on 1, 2, 4 and 8 CPUs
+// and how well idle CPUs steal work. Call from the main thread once all CPUs
+// are online.
+void sched_bench(void);
+
+#else
+
+static inline void sched_bench(void) {}
+
+#endif
+
+#endif
@@ -0,0 +1,545 @@
+#include "scheduler.h"
+#include "cpu.h"
+#include "instruction.h"
+#include "macro.h"
+#include "memory/heap.h"
+#include "memory/memory.h"
+#include "memory/pages.h"
+#include "panic.h"
+#include "string/utility.h"
+#include "sync/spinlock.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The idle thread ranks below every real priority and never sits in a queue.
+#define THREAD_PRIORITY_IDLE (THREAD_PRIORITY_COUNT)
+
+struct RUN_LIST {
+	struct THREAD *head;
+	struct THREAD *tail;
+};
+
+// Threads queued on one CPU, one FIFO per priority. Other CPUs only touch it
+// to queue a thread they woke up or to steal one while idle.
+struct RUN_QUEUE {
+	struct SPINLOCK lock;
+	struct RUN_LIST lists[THREAD_PRIORITY_COUNT];
+	uint32_t count; /* Read without the lock by CPUs looking to steal */
+	bool need_resched;
+	struct THREAD *current;
+	struct THREAD *idle;
+	struct THREAD *previous; /* Switched away from, finished by the next */
+	uint64_t switches;
+	uint64_t steals;
+	uint64_t preemptions;
+} ATTR_CACHE_ALIGN;
+
+// Lock order: a thread's `wait_lock` before any run queue lock. No CPU holds
+// two run queue locks at once.
+static struct RUN_QUEUE _run_queue ATTR_PER_CPU = {0};
+
+static struct SPINLOCK _wait_lock = SPINLOCK_INIT;
+static uint64_t _next_thread_id = 0;
+
+// Saves the callee saved registers on the current stack, stores the stack
+// pointer in `old_rsp` and resumes the thread whose stack pointer is `new_rsp`.
+extern void switch_context(uint64_t *old_rsp, uint64_t new_rsp);
+
+// First code a new thread runs, see `alloc_thread`.
+extern void thread_start_stub(void);
+
+static void list_push(struct RUN_LIST *list, struct THREAD *thread)
+{
+	thread->next = NULL;
+
+	if (list->tail == NULL) {
+		list->head = thread;
+	} else {
+		list->tail->next = thread;
+	}
+
+	list->tail = thread;
+}
+
+static struct THREAD *list_pop(struct RUN_LIST *list)
+{
+	struct THREAD *thread = list->head;
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	list->head = thread->next;
+	if (list->head == NULL) {
+		list->tail = NULL;
+	}
+
+	thread->next = NULL;
+	return thread;
+}
+
+// Takes the first thread which may move to another CPU.
+static struct THREAD *list_take_movable(struct RUN_LIST *list)
+{
+	struct THREAD *previous = NULL;
+
+	for (struct THREAD *thread = list->head; thread != NULL;
+		 previous = thread, thread = thread->next) {
+		// A thread still switching away on its CPU is left to that CPU.
+		if (thread->pinned ||
+			__atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		if (previous == NULL) {
+			list->head = thread->next;
+		} else {
+			previous->next = thread->next;
+		}
+
+		if (list->tail == thread) {
+			list->tail = previous;
+		}
+
+		thread->next = NULL;
+		return thread;
+	}
+
+	return NULL;
+}
+
+static void enqueue_locked(struct RUN_QUEUE *queue, struct THREAD *thread)
+{
+	thread->state = THREAD_READY;
+	list_push(&queue->lists[thread->priority], thread);
+	__atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELAXED);
+
+	if (queue->current != NULL &&
+		thread->priority < queue->current->priority) {
+		queue->need_resched = true;
+	}
+}
+
+static struct THREAD *dequeue_locked(struct RUN_QUEUE *queue)
+{
+	for (uint32_t i = 0; i < THREAD_PRIORITY_COUNT; i++) {
+		struct THREAD *thread = list_pop(&queue->lists[i]);
+		if (thread != NULL) {
+			__atomic_store_n(&queue->count, queue->count - 1,
+							 __ATOMIC_RELAXED);
+			return thread;
+		}
+	}
+
+	return NULL;
+}
+
+// Queues the thread on the CPU it last ran on. Queueing it anywhere else
+// could make that CPU wait for it to finish switching away while its own
+// thread is waited on in turn.
+static void enqueue(struct THREAD *thread)
+{
+	struct RUN_QUEUE *queue = per_cpu_ptr(&_run_queue, thread->cpu);
+
+	uint64_t flags = spin_lock_irqsave(&queue->lock);
+	enqueue_locked(queue, thread);
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+// Takes a thread from the CPU with the most queued threads.
+static struct THREAD *steal(struct RUN_QUEUE *own, uint32_t own_index)
+{
+	struct RUN_QUEUE *busiest = NULL;
+	uint32_t most = 0;
+
+	for (uint32_t i = 0; i < cpu_count(); i++) {
+		if (i == own_index || cpu_area(i) == NULL) {
+			continue;
+		}
+
+		struct RUN_QUEUE *queue = per_cpu_ptr(&_run_queue, i);
+		uint32_t count = __atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+
+		if (count > most) {
+			busiest = queue;
+			most = count;
+		}
+	}
+
+	if (busiest == NULL) {
+		return NULL;
+	}
+
+	struct THREAD *thread = NULL;
+
+	spin_lock(&busiest->lock);
+
+	for (uint32_t i = 0; i < THREAD_PRIORITY_COUNT && thread == NULL; i++) {
+		thread = list_take_movable(&busiest->lists[i]);
+	}
+
+	if (thread != NULL) {
+		__atomic_store_n(&busiest->count, busiest->count - 1,
+						 __ATOMIC_RELAXED);
+		own->steals++;
+	}
+
+	spin_unlock(&busiest->lock);
+
+	return thread;
+}
+
+static void free_thread(struct THREAD *thread)
+{
+	if (thread->stack != NULL) {
+		free_pages(thread->stack);
+	}
+
+	kfree(thread);
+}
+
+// Runs on the new thread's stack right after every switch.
+static void finish_switch(void)
+{
+	struct RUN_QUEUE *queue = this_cpu_ptr(&_run_queue);
+	struct THREAD *previous = queue->previous;
+
+	queue->previous = NULL;
+
+	if (previous->state == THREAD_DEAD) {
+		free_thread(previous);
+		return;
+	}
+
+	__atomic_store_n(&previous->on_cpu, false, __ATOMIC_RELEASE);
+}
+
+static void switch_to(struct RUN_QUEUE *queue, struct THREAD *previous,
+					  struct THREAD *next)
+{
+	// Only a thread which was switched away from on this very CPU can still
+	// be on one, so this never waits for long.
+	while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) {
+		cpu_relax();
+	}
+
+	next->on_cpu = true;
+	next->state = THREAD_RUNNING;
+	next->cpu = cpu_index();
+	next->switches++;
+
+	queue->current = next;
+	queue->previous = previous;
+	queue->switches++;
+
+	switch_context(&previous->rsp, next->rsp);
+
+	// Back on `previous`, possibly on another CPU.
+	finish_switch();
+}
+
+void schedule(void)
+{
+	uint64_t flags = save_and_disable_interrupts();
+
+	struct RUN_QUEUE *queue = this_cpu_ptr(&_run_queue);
+	struct THREAD *previous = queue->current;
+
+	spin_lock(&queue->lock);
+
+	queue->need_resched = false;
+
+	// Blocked and dead threads stay off the queue. A blocked thread which was
+	// woken in the meantime is already back on it.
+	if (previous->state == THREAD_RUNNING && previous != queue->idle) {
+		previous->slice = THREAD_SLICE_TICKS;
+		enqueue_locked(queue, previous);
+	}
+
+	struct THREAD *next = dequeue_locked(queue);
+
+	spin_unlock(&queue->lock);
+
+	if (next == NULL) {
+		next = steal(queue, cpu_index());
+	}
+
+	if (next == NULL) {
+		next = queue->idle;
+	}
+
+	if (next == previous) {
+		previous->state = THREAD_RUNNING;
+	} else {
+		switch_to(queue, previous, next);
+	}
+
+	restore_interrupts(flags);
+}
+
+// Called by `thread_start_stub` on the new thread's stack.
+NO_RETURN void thread_bootstrap(struct THREAD *thread)
+{
+	finish_switch();
+	enable_interrupts();
+
+	thread->entry(thread->argument);
+
+	thread_exit();
+}
+
+// Allocates a thread and lays out its stack like `switch_context` left it, so
+// the first switch to it pops zeroed registers and returns into
+// `thread_start_stub` with the thread in rbx.
+static struct THREAD *alloc_thread(const char *name, thread_entry entry,
+								   void *argument, uint32_t priority)
+{
+	struct THREAD *thread = kzalloc(sizeof(struct THREAD));
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->stack = alloc_pages(THREAD_STACK_PAGES);
+	if (thread->stack == NULL) {
+		kfree(thread);
+		return NULL;
+	}
+
+	thread->id = __atomic_fetch_add(&_next_thread_id, 1, __ATOMIC_RELAXED);
+	thread->name = name;
+	thread->priority = priority;
+	thread->slice = THREAD_SLICE_TICKS;
+	thread->entry = entry;
+	thread->argument = argument;
+
+	uint64_t *stack = (uint64_t *)((uintptr_t)thread->stack +
+								   THREAD_STACK_PAGES * PAGE_BYTE_SIZE);
+
+	*--stack = (uint64_t)thread_start_stub;
+	*--stack = 0; // rbp
+	*--stack = (uint64_t)thread; // rbx
+	*--stack = 0; // r12
+	*--stack = 0; // r13
+	*--stack = 0; // r14
+	*--stack = 0; // r15
+
+	thread->rsp = (uint64_t)stack;
+
+	return thread;
+}
+
+// Wraps the context the CPU is already running in into a thread.
+static struct THREAD *adopt_boot_context(const char *name, uint32_t priority)
+{
+	struct THREAD *thread = kzalloc(sizeof(struct THREAD));
+	if (thread == NULL) {
+		panicf("Could not allocate the boot thread of CPU %u\n", cpu_index());
+	}
+
+	thread->id = __atomic_fetch_add(&_next_thread_id, 1, __ATOMIC_RELAXED);
+	thread->name = name;
+	thread->state = THREAD_RUNNING;
+	thread->priority = priority;
+	thread->cpu = cpu_index();
+	thread->pinned = true;
+	thread->on_cpu = true;
+	thread->slice = THREAD_SLICE_TICKS;
+
+	return thread;
+}
+
+// Nothing can wake up a halted CPU yet, so idle CPUs keep polling their own
+// queue and the others.
+NO_RETURN static void idle_loop(void *argument)
+{
+	(void)argument;
+
+	for (;;) {
+		schedule();
+		cpu_relax();
+	}
+}
+
+void init_scheduler(void)
+{
+	struct RUN_QUEUE *queue = this_cpu_ptr(&_run_queue);
+
+	printf(KINFO "Starting the scheduler...\n");
+
+	struct THREAD *idle =
+		alloc_thread("idle", idle_loop, NULL, THREAD_PRIORITY_IDLE);
+	if (idle == NULL) {
+		panicf("Could not allocate the idle thread\n");
+	}
+
+	idle->cpu = cpu_index();
+	idle->pinned = true;
+
+	queue->idle = idle;
+	queue->current = adopt_boot_context("main", THREAD_PRIORITY_NORMAL);
+
+	printf("\tPriorities: %u Slice: %u ticks Stack: %'llu bytes\n",
+		   THREAD_PRIORITY_COUNT, THREAD_SLICE_TICKS,
+		   THREAD_STACK_PAGES * PAGE_BYTE_SIZE);
+	printf(KOK "Scheduler running\n");
+}
+
+NO_RETURN void scheduler_start_cpu(void)
+{
+	struct RUN_QUEUE *queue = this_cpu_ptr(&_run_queue);
+
+	queue->idle = adopt_boot_context("idle", THREAD_PRIORITY_IDLE);
+	queue->current = queue->idle;
+
+	idle_loop(NULL);
+}
+
+struct THREAD *thread_create(const char *name, thread_entry entry,
+							 void *argument, enum THREAD_PRIORITY priority,
+							 int32_t cpu)
+{
+	if (priority >= THREAD_PRIORITY_COUNT ||
+		(cpu != THREAD_ANY_CPU && (uint32_t)cpu >= cpu_count())) {
+		return NULL;
+	}
+
+	struct THREAD *thread = alloc_thread(name, entry, argument, priority);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->pinned = cpu != THREAD_ANY_CPU;
+	thread->cpu = thread->pinned ? (uint32_t)cpu : cpu_index();
+
+	enqueue(thread);
+
+	return thread;
+}
+
+struct THREAD *thread_current(void)
+{
+	uint64_t flags = save_and_disable_interrupts();
+	struct THREAD *thread = this_cpu_ptr(&_run_queue)->current;
+	restore_interrupts(flags);
+
+	return thread;
+}
+
+void thread_yield(void) { schedule(); }
+
+void thread_block(void)
+{
+	uint64_t flags = spin_lock_irqsave(&_wait_lock);
+
+	struct THREAD *thread = this_cpu_ptr(&_run_queue)->current;
+
+	if (thread->wake_pending) {
+		thread->wake_pending = false;
+		spin_unlock_irqrestore(&_wait_lock, flags);
+		return;
+	}
+
+	thread->state = THREAD_BLOCKED;
+
+	spin_unlock(&_wait_lock);
+
+	schedule();
+
+	restore_interrupts(flags);
+}
+
+void thread_wake(struct THREAD *thread)
+{
+	uint64_t flags = spin_lock_irqsave(&_wait_lock);
+
+	if (thread->state != THREAD_BLOCKED) {
+		// Not blocked yet, its next `thread_block` returns right away.
+		thread->wake_pending = true;
+		spin_unlock_irqrestore(&_wait_lock, flags);
+		return;
+	}
+
+	enqueue(thread);
+
+	spin_unlock(&_wait_lock);
+
+	// Interrupt handlers run with interrupts off, so with them on this is a
+	// thread which may give way to the one it woke right away.
+	struct RUN_QUEUE *queue = this_cpu_ptr(&_run_queue);
+	if ((flags & RFLAGS_IF) && queue->need_resched) {
+		schedule();
+	}
+
+	restore_interrupts(flags);
+}
+
+NO_RETURN void thread_exit(void)
+{
+	disable_interrupts();
+
+	this_cpu_ptr(&_run_queue)->current->state = THREAD_DEAD;
+	schedule();
+
+	panicf("Dead thread was scheduled again\n");
+}
+
+void scheduler_tick(void)
+{
+	struct RUN_QUEUE *queue = this_cpu_ptr(&_run_queue);
+	struct THREAD *current = queue->current;
+
+	if (current == NULL) {
+		return;
+	}
+
+	bool waiting = __atomic_load_n(&queue->count, __ATOMIC_RELAXED) > 0;
+
+	if (current == queue->idle) {
+		queue->need_resched |= waiting;
+		return;
+	}
+
+	if (current->slice > 0) {
+		current->slice--;
+	}
+
+	if (current->slice == 0) {
+		if (waiting) {
+			queue->need_resched = true;
+		} else {
+			current->slice = THREAD_SLICE_TICKS;
+		}
+	}
+}
+
+void scheduler_preempt(void)
+{
+	struct RUN_QUEUE *queue = this_cpu_ptr(&_run_queue);
+
+	if (queue->current == NULL || !queue->need_resched) {
+		return;
+	}
+
+	queue->preemptions++;
+	schedule();
+}
+
+void scheduler_stats(uint32_t cpu, struct SCHEDULER_STATS *stats)
+{
+	memset(stats, 0, sizeof(struct SCHEDULER_STATS));
+
+	if (cpu >= cpu_count() || cpu_area(cpu) == NULL) {
+		return;
+	}
+
+	struct RUN_QUEUE *queue = per_cpu_ptr(&_run_queue, cpu);
+
+	uint64_t flags = spin_lock_irqsave(&queue->lock);
+
+	stats->switches = queue->switches;
+	stats->steals = queue->steals;
+	stats->preemptions = queue->preemptions;
+	stats->queued = queue->count;
+
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
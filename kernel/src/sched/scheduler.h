@@ -0,0 +1,106 @@
+#ifndef __SCHED_SCHEDULER_H
+#define __SCHED_SCHEDULER_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define THREAD_STACK_PAGES (16)
+
+// Timer ticks a thread may run before it is preempted in favour of another
+// thread of the same priority.
+#define THREAD_SLICE_TICKS (4)
+
+// Passed as the CPU to let the scheduler place the thread and move it between
+// CPUs as it sees fit.
+#define THREAD_ANY_CPU (-1)
+
+// Ready threads of a higher priority always run before those of a lower one.
+enum THREAD_PRIORITY {
+	THREAD_PRIORITY_HIGH = 0,
+	THREAD_PRIORITY_NORMAL = 1,
+	THREAD_PRIORITY_LOW = 2,
+	THREAD_PRIORITY_COUNT = 3,
+};
+
+enum THREAD_STATE {
+	THREAD_READY,
+	THREAD_RUNNING,
+	THREAD_BLOCKED,
+	THREAD_DEAD,
+};
+
+typedef void (*thread_entry)(void *argument);
+
+struct THREAD {
+	uint64_t rsp; /* Saved stack pointer, has to stay first for the switch */
+	uint64_t id;
+	const char *name;
+	enum THREAD_STATE state;
+	enum THREAD_PRIORITY priority;
+	uint32_t cpu; /* CPU the thread last ran on or is queued on */
+	bool pinned; /* Never moved to another CPU */
+	bool on_cpu; /* Still running or being switched away from */
+	bool wake_pending; /* Woken before it got to block */
+	uint32_t slice; /* Ticks left before it gets preempted */
+	void *stack; /* NULL for threads which took over a boot stack */
+	thread_entry entry;
+	void *argument;
+	uint64_t switches; /* Times the thread was switched to */
+	struct THREAD *next;
+};
+
+struct SCHEDULER_STATS {
+	uint64_t switches;
+	uint64_t steals; /* Threads this CPU took from other queues */
+	uint64_t preemptions;
+	uint32_t queued;
+};
+
+// Turns the boot context of the bootstrap processor into the first thread and
+// sets up its run queue. Has to run before `init_smp`.
+void init_scheduler(void);
+
+// Turns the boot context of an application processor into its idle thread and
+// starts scheduling on it.
+__attribute__((noreturn)) void scheduler_start_cpu(void);
+
+// Creates a thread and queues it on the given CPU. With `THREAD_ANY_CPU` it is
+// queued on the executing CPU and may be stolen by idle ones. Returns NULL if
+// the thread could not be allocated.
+struct THREAD *thread_create(const char *name, thread_entry entry,
+							 void *argument, enum THREAD_PRIORITY priority,
+							 int32_t cpu);
+
+// Gets the executing thread.
+struct THREAD *thread_current(void);
+
+// Lets other ready threads of the same or a higher priority run.
+void thread_yield(void);
+
+// Blocks the executing thread until `thread_wake` is called on it. A wake up
+// which arrives before the thread got to block is not lost.
+void thread_block(void);
+
+// Readies a blocked thread. Does nothing if it is not blocked.
+void thread_wake(struct THREAD *thread);
+
+// Ends the executing thread. Returning from the entry point does the same.
+__attribute__((noreturn)) void thread_exit(void);
+
+// Picks the next thread to run on the executing CPU. Call with interrupts
+// enabled or from an interrupt handler at the very end.
+void schedule(void);
+
+// Accounts a timer tick to the executing thread. Called from the timer
+// interrupt, which should call `scheduler_preempt` before returning.
+void scheduler_tick(void);
+
+// Switches away from the executing thread if its slice ran out or a thread
+// of higher priority got ready. Only call it at the end of an interrupt
+// handler, after the interrupt was acknowledged.
+void scheduler_preempt(void);
+
+void scheduler_stats(uint32_t cpu, struct SCHEDULER_STATS *stats);
+
+#endif
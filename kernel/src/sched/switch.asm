@@ -0,0 +1,40 @@
+[BITS 64]
+[EXTERN thread_bootstrap:function]
+
+SECTION .text
+GLOBAL switch_context:function
+switch_context:
+	; void switch_context(uint64_t *old_rsp, uint64_t new_rsp)
+	; INPUT:
+	;	First param 'old_rsp' is contained in 'rdi'.
+	;	Second param 'new_rsp' is contained in 'rsi'.
+	; OUTPUT:
+	;	void
+
+	; Only the callee saved registers need saving, the caller of
+	; 'switch_context' already expects the others to be clobbered.
+	push rbp
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+
+	mov [rdi], rsp
+	mov rsp, rsi
+
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	pop rbp
+
+	ret
+
+GLOBAL thread_start_stub:function
+thread_start_stub:
+	; First return target of a new thread. 'rbx' holds the thread.
+	mov rdi, rbx
+	call thread_bootstrap
+	ud2
@@ -3,9 +3,13 @@
 
 #include "../devices/tty.h"
 #include "../serial.h"
+#include "../sync/spinlock.h"
 #include "color.h"
 #include "utility.h"
 
+// Keeps the output of processors printing at the same time apart.
+static struct SPINLOCK _print_lock = SPINLOCK_INIT;
+
 int printf(const char *restrict format, ...)
 {
 	char buffer[512];
@@ -17,6 +21,8 @@ int printf(const char *restrict format, ...)
 
 	va_end(args);
 
+	uint64_t flags = spin_lock_irqsave(&_print_lock);
+
 	for (size_t i = 0; i < written; i++) {
 		if (buffer[i] == '\e') {
 			if (memcmp(buffer + i, BLK, 7) == 0) {
@@ -47,5 +53,7 @@ int printf(const char *restrict format, ...)
 		TTY_puts(buffer);
 	}
 
+	spin_unlock_irqrestore(&_print_lock, flags);
+
 	return written;
 }
@@ -0,0 +1,52 @@
+#ifndef __SYNC_SPINLOCK_H
+#define __SYNC_SPINLOCK_H 1
+
+#include "instruction.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Test and test-and-set spinlock. Locks which may be taken from interrupt
+// context must always be taken with the `_irqsave` variants, otherwise an
+// interrupt arriving while the lock is held deadlocks the CPU.
+struct SPINLOCK {
+	uint32_t locked;
+};
+
+#define SPINLOCK_INIT {0}
+
+static inline bool spin_try_lock(struct SPINLOCK *lock)
+{
+	return __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_lock(struct SPINLOCK *lock)
+{
+	while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+		// Wait with plain loads so waiters do not keep stealing the cache line
+		// from the owner.
+		while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+			cpu_relax();
+		}
+	}
+}
+
+static inline void spin_unlock(struct SPINLOCK *lock)
+{
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t spin_lock_irqsave(struct SPINLOCK *lock)
+{
+	uint64_t flags = save_and_disable_interrupts();
+	spin_lock(lock);
+	return flags;
+}
+
+static inline void spin_unlock_irqrestore(struct SPINLOCK *lock,
+										  uint64_t flags)
+{
+	spin_unlock(lock);
+	restore_interrupts(flags);
+}
+
+#endif